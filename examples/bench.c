@@ -0,0 +1,204 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * bench.c
+ * measures playback and export throughput of a file, range queries,
+ * undo steps and output dispatch
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <vomid.h>
+
+static void
+die(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+
+	exit(1);
+}
+
+static void
+event_clb(unsigned char *ev, size_t size, void *arg)
+{
+	(*(long *)arg)++;
+}
+
+static vmd_status_t
+delay_clb(vmd_time_t delay, int tempo, void *arg)
+{
+	return VMD_OK;
+}
+
+static double
+seconds(clock_t since)
+{
+	return (double)(clock() - since) / CLOCKS_PER_SEC;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		die("Usage: %s file.mid [runs]\n", argv[0]);
+	int runs = argc >= 3 ? atoi(argv[2]) : 10;
+
+	vmd_file_t file;
+	if (vmd_file_import(&file, argv[1], NULL) != VMD_OK)
+		die("File import failed\n");
+
+	long events = 0;
+	clock_t start = clock();
+	for (int i = 0; i < runs; i++)
+		vmd_file_play(&file, 0, event_clb, delay_clb, &events, NULL);
+	double t = seconds(start);
+	printf("play:   %ld events in %.3f s, %.0f events/s\n", events, t, events / t);
+
+	size_t bytes = 0;
+	start = clock();
+	for (int i = 0; i < runs; i++) {
+		void *data;
+		size_t size;
+		if (vmd_file_export_mem(&file, &data, &size) != VMD_OK)
+			die("Export failed\n");
+		bytes += size;
+		free(data);
+	}
+	t = seconds(start);
+	printf("export: %lu bytes in %.3f s, %.0f events/s\n", (unsigned long)bytes, t, events / t);
+
+	/* piano roll viewports (1/100 of the length, an octave) over the biggest track */
+	vmd_track_t *track = NULL;
+	size_t notes = 0;
+	for (int i = 0; i < file.tracks; i++) {
+		size_t n = vmd_track_range_into(file.track[i], 0, VMD_MAX_TIME, 0, VMD_MAX_PITCH, NULL, 0);
+		if (track == NULL || n > notes) {
+			track = file.track[i];
+			notes = n;
+		}
+	}
+	if (track != NULL) {
+		static vmd_note_t *found[1 << 16];
+		vmd_time_t len = vmd_track_length(track), win = len / 100 + 1;
+		long queries = runs * 1000L;
+
+		printf("range:  %lu notes,", (unsigned long)notes);
+		for (int indexed = 0; indexed < 2; indexed++) {
+			if (indexed && vmd_track_index_pitches(track, VMD_TRUE) != VMD_OK)
+				die("Pitch index failed\n");
+			srand(1);
+			start = clock();
+			for (long i = 0; i < queries; i++) {
+				vmd_time_t s = rand() % (len + 1);
+				vmd_pitch_t p = rand() % 116;
+				vmd_track_range_into(track, s, s + win, p, p + 12, found, 1 << 16);
+			}
+			t = seconds(start);
+			printf(" %.0f queries/s%s", queries / t, indexed ? " indexed\n" : ",");
+		}
+		vmd_track_index_pitches(track, VMD_FALSE);
+
+		/* undo steps: put one note back in place and commit */
+		long steps = runs * 1000L;
+		vmd_file_rev_t **revs = malloc((steps + 1) * sizeof(*revs));
+		if (revs == NULL || (revs[0] = vmd_file_commit(&file)) == NULL)
+			die("Commit failed\n");
+		start = clock();
+		for (long i = 1; i <= steps; i++) {
+			vmd_note_t *note = vmd_track_note(vmd_bst_root(&track->notes));
+			vmd_time_t on = note->on_time, off = note->off_time;
+			vmd_pitch_t pitch = note->pitch;
+			vmd_erase_note(note);
+			vmd_track_insert(track, on, off, pitch);
+			if ((revs[i] = vmd_file_commit(&file)) == NULL)
+				die("Commit failed\n");
+		}
+		t = seconds(start);
+		printf("commit: %ld one-note edits, %.1f us each\n", steps, t / steps * 1e6);
+
+		/* and jumping through that history */
+		long span = steps < 1000 ? steps : 1000;
+		start = clock();
+		for (int i = 0; i < 100; i++) {
+			vmd_file_update(&file, revs[steps - span]);
+			vmd_file_update(&file, revs[steps]);
+		}
+		t = seconds(start);
+		printf("undo:   %.1f us to go %ld revisions back and forth\n", t / 100 * 1e6, span);
+
+		/* and forgetting most of it */
+		size_t history = vmd_file_history_size(&file);
+		start = clock();
+		vmd_file_prune(&file, 100, NULL, 0);
+		t = seconds(start);
+		printf("prune:  history %zu -> %zu KB in %.1f ms\n", history / 1024,
+			vmd_file_history_size(&file) / 1024, t * 1e3);
+		free(revs);
+
+		/* what it takes to play the file while it's edited */
+		vmd_player_t *player = vmd_player_create(&file, NULL, NULL);
+		if (player != NULL) {
+			start = clock();
+			if (vmd_player_publish(player) != VMD_OK)
+				die("Publish failed\n");
+			double full = seconds(start);
+
+			start = clock();
+			for (int i = 0; i < runs; i++) {
+				vmd_note_t *note = vmd_track_note(vmd_bst_root(&track->notes));
+				vmd_time_t on = note->on_time, off = note->off_time;
+				vmd_pitch_t pitch = note->pitch;
+				vmd_erase_note(note);
+				vmd_track_insert(track, on, off, pitch);
+				if (vmd_file_commit(&file) == NULL || vmd_player_publish(player) != VMD_OK)
+					die("Publish failed\n");
+			}
+			t = seconds(start);
+			printf("publish: %.1f ms for the file, %.3f ms after a one-note commit\n",
+				full * 1e3, t / runs * 1e3);
+			vmd_player_destroy(player);
+		}
+	}
+
+	/* dispatch overhead, without a device behind it */
+	if (vmd_set_device(VMD_OUTPUT_DEVICE, "null/") != VMD_OK)
+		die("No null output device\n");
+
+	const unsigned char *evs[VMD_CHANNELS];
+	size_t sizes[VMD_CHANNELS];
+	unsigned char buf[VMD_CHANNELS][3];
+	for (int i = 0; i < VMD_CHANNELS; i++) {
+		buf[i][0] = 0x90 + i;
+		buf[i][1] = 60;
+		buf[i][2] = 64;
+		evs[i] = buf[i];
+		sizes[i] = 3;
+	}
+	long bursts = runs * 100000L;
+
+	start = clock();
+	for (long i = 0; i < bursts; i++) {
+		for (int j = 0; j < VMD_CHANNELS; j++)
+			vmd_output(evs[j], sizes[j]);
+		vmd_flush_output();
+	}
+	t = seconds(start);
+	printf("output: %.0f events/s one by one, ", bursts * VMD_CHANNELS / t);
+
+	start = clock();
+	for (long i = 0; i < bursts; i++) {
+		vmd_output_batch(evs, sizes, VMD_CHANNELS);
+		vmd_flush_output();
+	}
+	t = seconds(start);
+	printf("%.0f events/s batched\n", bursts * VMD_CHANNELS / t);
+
+	vmd_file_fini(&file);
+	return 0;
+}
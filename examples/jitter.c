@@ -0,0 +1,56 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * jitter.c
+ * measures how late vmd_sleep() and vmd_sleep_till() wake up
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vomid.h>
+
+static int
+cmp(const void *a, const void *b)
+{
+	vmd_systime_t x = *(const vmd_systime_t *)a, y = *(const vmd_systime_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, vmd_systime_t *err, int n)
+{
+	qsort(err, n, sizeof(*err), cmp);
+	printf("%-12s p50 %7.1f us, p99 %7.1f us, max %7.1f us\n", name,
+		err[n / 2] * 1e6, err[n * 99 / 100] * 1e6, err[n - 1] * 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+	int n = argc >= 2 ? atoi(argv[1]) : 1000;
+	vmd_systime_t *err = malloc(n * sizeof(*err));
+	if (n <= 0 || err == NULL)
+		return 1;
+
+	printf("slack %.1f us\n", vmd_sleep_slack() * 1e6);
+
+	/* sleeps of 0.1 to 2 ms */
+	srand(1);
+	for (int i = 0; i < n; i++) {
+		vmd_systime_t t = vmd_systime() + 0.0001 + 0.0019 * rand() / RAND_MAX;
+		vmd_sleep(t - vmd_systime());
+		err[i] = vmd_systime() - t;
+	}
+	report("sleep", err, n);
+
+	srand(1);
+	for (int i = 0; i < n; i++) {
+		vmd_systime_t t = vmd_systime() + 0.0001 + 0.0019 * rand() / RAND_MAX;
+		vmd_sleep_till(t);
+		err[i] = vmd_systime() - t;
+	}
+	report("sleep_till", err, n);
+
+	free(err);
+	return 0;
+}
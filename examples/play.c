@@ -76,6 +76,8 @@ main(int argc, char **argv)
 	printf("\n");
 
 	vmd_enum_devices(VMD_OUTPUT_DEVICE, set_enum_clb, argv[1]);
+	if (!device_set && vmd_set_device(VMD_OUTPUT_DEVICE, argv[1]) == VMD_OK)
+		device_set = 1;
 	if (!device_set)
 		die("Could not open output port\n");
 	vmd_file_play(&file, 0, event_clb, delay_clb, &file, NULL);
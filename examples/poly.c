@@ -0,0 +1,67 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * poly.c
+ * measures inserting and flattening heavily polyphonic tracks of growing size
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <vomid.h>
+
+#define VOICES 32 /* notes sounding at once */
+#define STEP 10
+
+static void
+die(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+
+	exit(1);
+}
+
+static double
+seconds(clock_t since)
+{
+	return (double)(clock() - since) / CLOCKS_PER_SEC;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_notes = argc >= 2 ? atoi(argv[1]) : 64000;
+
+	printf("%8s %14s %14s\n", "notes", "insert, us", "commit, us");
+	for (int notes = 1000; notes <= max_notes; notes *= 2) {
+		vmd_file_t file;
+		vmd_file_init(&file);
+		vmd_track_t *track = vmd_track_create(&file, VMD_CHANMASK_NODRUMS);
+		file.track[file.tracks++] = track;
+
+		srand(1);
+		clock_t start = clock();
+		for (int i = 0; i < notes; i++) {
+			vmd_time_t on = i * STEP + rand() % STEP;
+			/* pitches repeat every 128 notes, long after they stopped sounding */
+			vmd_note_t *note = vmd_track_insert(track, on, on + VOICES * STEP / 2 + rand() % (VOICES * STEP), i * 37 % 128);
+			if (i % 8 == 0)
+				vmd_note_set_cctrl(note, VMD_CCTRL_VOLUME, rand() % 128);
+		}
+		double insert = seconds(start);
+
+		start = clock();
+		if (vmd_file_commit(&file) == NULL)
+			die("Commit failed at %i notes\n", notes);
+		double commit = seconds(start);
+
+		printf("%8i %14.2f %14.2f\n", notes, insert / notes * 1e6, commit / notes * 1e6);
+		vmd_file_fini(&file);
+	}
+	return 0;
+}
@@ -25,12 +25,20 @@ typedef struct vmd_note_t vmd_note_t;
 typedef struct vmd_bst_t vmd_bst_t;
 typedef struct vmd_bst_node_t vmd_bst_node_t;
 typedef struct vmd_bst_rev_t vmd_bst_rev_t;
+typedef struct vmd_pbst_t vmd_pbst_t;
+typedef struct vmd_pbst_node_t vmd_pbst_node_t;
+typedef struct vmd_pbst_iter_t vmd_pbst_iter_t;
 typedef struct vmd_map_t vmd_map_t;
 typedef struct vmd_map_bstdata_t vmd_map_bstdata_t;
 typedef struct vmd_pool_t vmd_pool_t;
 typedef struct vmd_file_rev_t vmd_file_rev_t;
 typedef struct vmd_measure_t vmd_measure_t;
+typedef struct vmd_track_range_iter_t vmd_track_range_iter_t;
+typedef struct vmd_pitch_index_t vmd_pitch_index_t;
 typedef struct vmd_play_ctx_t vmd_play_ctx_t;
+typedef struct vmd_player_t vmd_player_t;
+typedef struct vmd_player_stats_t vmd_player_stats_t;
+typedef struct vmd_null_stats_t vmd_null_stats_t;
 
 typedef int vmd_status_t;
 #define VMD_ERROR (-1)
@@ -129,6 +137,7 @@ struct vmd_bst_node_t {
 	/* only used internally in bst_update(),
 	 * so we can use it for node marking */
 	unsigned was_in_tree    :1;
+	unsigned will_be_in_tree:1;
 
 	char data[0];
 };
@@ -169,6 +178,9 @@ struct vmd_bst_t {
 	vmd_bst_rev_t  *tip;
 	vmd_bst_node_t *inserted, *erased, *free, *save;
 	size_t          tree_size;
+
+	struct vmd_bst_block_t *blocks;
+	size_t          block_free;
 };
 
 void vmd_bst_init(vmd_bst_t *, size_t, size_t, vmd_bst_cmp_t, vmd_bst_upd_t);
@@ -180,6 +192,8 @@ vmd_bst_node_t *vmd_bst_insert(vmd_bst_t *, const void *);
 vmd_bst_node_t *vmd_bst_erase(vmd_bst_t *, vmd_bst_node_t *);
 void            vmd_bst_erase_range(vmd_bst_t *, vmd_bst_node_t *, vmd_bst_node_t *);
 void            vmd_bst_change(vmd_bst_t *, vmd_bst_node_t *, const void *);
+vmd_bst_node_t *vmd_bst_append_sorted(vmd_bst_t *, const void *, size_t n, size_t size);
+vmd_bst_node_t *vmd_bst_build_sorted(vmd_bst_t *, const void *, size_t n, size_t size);
 
 vmd_bst_node_t *vmd_bst_find(vmd_bst_t *tree, const void *data);
 vmd_bst_node_t *vmd_bst_bound(vmd_bst_t *tree, const void *data, int bound);
@@ -187,8 +201,11 @@ vmd_bst_node_t *vmd_bst_lower_bound(vmd_bst_t *tree, const void *data);
 vmd_bst_node_t *vmd_bst_upper_bound(vmd_bst_t *tree, const void *data);
 
 vmd_bst_rev_t  *vmd_bst_commit(vmd_bst_t *);
+vmd_bool_t      vmd_bst_dirty(vmd_bst_t *);
 vmd_bst_node_t *vmd_bst_revert(vmd_bst_t *);
 vmd_bst_node_t *vmd_bst_update(vmd_bst_t *, vmd_bst_rev_t *);
+void            vmd_bst_prune(vmd_bst_t *, vmd_bst_rev_t **keep, int n);
+size_t          vmd_bst_history_size(vmd_bst_t *);
 
 #define VMD_BST_FOREACH(node, bst) \
 	for (vmd_bst_node_t *_node_ = vmd_bst_begin(bst), *_cont_ = _node_; \
@@ -196,13 +213,63 @@ vmd_bst_node_t *vmd_bst_update(vmd_bst_t *, vmd_bst_rev_t *);
 		_cont_ = _node_ = vmd_bst_next(_node_)) \
 		for (node = _node_; _cont_; _cont_ = NULL)
 
+/* pbst.c */
+
+/*
+ * fully persistent AVL tree. nodes shared with a committed root are never
+ * changed, the path to them gets copied instead, so a committed root stays
+ * as it was and can be read from any thread while the tree goes on changing.
+ * nodes are reference counted and freed when the last root using them is.
+ */
+
+struct vmd_pbst_node_t {
+	vmd_pbst_node_t *child[2];
+	int              refs; /* parents and committed roots pointing here */
+	int              height;
+	char             data[0];
+};
+
+struct vmd_pbst_t {
+	vmd_pbst_node_t *root;
+	size_t           dsize;
+	vmd_bst_cmp_t    cmp;
+	size_t           size;
+};
+
+/* enough for any AVL tree that fits in memory */
+#define VMD_PBST_MAX_HEIGHT 64
+
+struct vmd_pbst_iter_t {
+	const vmd_pbst_node_t *stack[VMD_PBST_MAX_HEIGHT];
+	int depth;
+};
+
+void             vmd_pbst_init(vmd_pbst_t *, size_t dsize, vmd_bst_cmp_t);
+void             vmd_pbst_fini(vmd_pbst_t *);
+vmd_status_t     vmd_pbst_insert(vmd_pbst_t *, const void *);
+vmd_status_t     vmd_pbst_erase(vmd_pbst_t *, const void *);
+vmd_pbst_node_t *vmd_pbst_commit(vmd_pbst_t *);
+void             vmd_pbst_release(vmd_pbst_node_t *);
+
+/* these only read, and work on any root: committed or tree->root */
+const void *     vmd_pbst_find(const vmd_pbst_node_t *, const void *, vmd_bst_cmp_t);
+const void *     vmd_pbst_lower_bound(vmd_pbst_iter_t *, const vmd_pbst_node_t *, const void *, vmd_bst_cmp_t);
+const void *     vmd_pbst_begin(vmd_pbst_iter_t *, const vmd_pbst_node_t *);
+const void *     vmd_pbst_next(vmd_pbst_iter_t *);
+
 /* map.c */
 
 struct vmd_map_t {
 	vmd_bst_t bst;
 	int default_value;
+
+	/* optional bit set whenever something is put into the map */
+	uint64_t *used;
+	uint64_t used_bit;
 };
 
+#define VMD_BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
 struct vmd_map_bstdata_t {
 	vmd_time_t time;
 	int value;
@@ -210,6 +277,7 @@ struct vmd_map_bstdata_t {
 
 void vmd_map_init(vmd_map_t *, int default_value);
 void vmd_map_fini(vmd_map_t *);
+void vmd_map_track_usage(vmd_map_t *, uint64_t *bitmap, int bit);
 
 int  vmd_map_get(vmd_map_t *, vmd_time_t, vmd_time_t *);
 void vmd_map_get_change(vmd_map_t *, vmd_time_t *, int *);
@@ -229,8 +297,13 @@ int        vmd_map_value(vmd_bst_node_t *node);
 struct vmd_channel_t {
 	int number;
 	vmd_bst_t notes;
-	vmd_map_t ctrl[VMD_CCTRLS];
+	/* controllers that were never written point to shared read-only
+	 * defaults; use vmd_channel_ctrl() to get a writable one */
+	vmd_map_t *ctrl[VMD_CCTRLS];
 	vmd_channel_t *next;
+
+	/* controllers that might be non-empty; bits are never cleared */
+	uint64_t used_ctrls[VMD_BITMAP_WORDS(VMD_CCTRLS)];
 };
 
 /* pool.c */
@@ -248,18 +321,31 @@ char *vmd_pool_strdup(vmd_pool_t *, const char *);
 
 #define VMD_MAX_TRACKS 32
 
+/* checksum written on export; import picks up the one found in the file */
+enum {
+	VMD_CHECKSUM_SHA1,
+	VMD_CHECKSUM_HASH64  /* fast, non-cryptographic */
+};
+
 struct vmd_file_t {
 	unsigned int   division;
 	int            tracks;
 	vmd_bool_t     force_compatible;
+	int            checksum;
 
 	vmd_track_t   *track[VMD_MAX_TRACKS];
 	vmd_channel_t  channel[VMD_CHANNELS];
 	vmd_map_t      ctrl[VMD_FCTRLS];
+	uint64_t       used_ctrls[VMD_BITMAP_WORDS(VMD_FCTRLS)]; /* see vmd_channel_t */
 	vmd_track_t   *tracks_list;
 
 	vmd_map_t      measure_index;
 	vmd_pool_t     pool;
+
+	/* the revision last committed or updated to */
+	vmd_file_rev_t *rev;
+	/* all the committed revisions, newest first */
+	vmd_file_rev_t *revs;
 };
 
 void            vmd_file_init(vmd_file_t *);
@@ -269,6 +355,8 @@ char *          vmd_file_copy_string(vmd_file_t *, const char *);
 vmd_status_t    vmd_file_flatten(vmd_file_t *);
 vmd_file_rev_t *vmd_file_commit(vmd_file_t *);
 void            vmd_file_update(vmd_file_t *, vmd_file_rev_t *);
+void            vmd_file_prune(vmd_file_t *, int last, vmd_file_rev_t **pinned, int n);
+size_t          vmd_file_history_size(vmd_file_t *);
 
 vmd_status_t    vmd_file_import(vmd_file_t *, const char *, vmd_bool_t *sha_ok);
 vmd_status_t    vmd_file_export(vmd_file_t *, const char *);
@@ -291,11 +379,19 @@ void vmd_file_measure_at(vmd_file_t *, vmd_time_t, vmd_measure_t *);
 
 /* import.c */
 
+/* *sha_ok tells whether the checksum stored in the file (SHA1 or HASH64) matches */
 vmd_status_t vmd_file_import_f(vmd_file_t *, FILE *, vmd_bool_t *sha_ok);
+vmd_status_t vmd_file_import_mem(vmd_file_t *, const void *, size_t, vmd_bool_t *sha_ok);
+/* maps the file into memory where supported, reads it otherwise */
+vmd_status_t vmd_file_import_mmap(vmd_file_t *, const char *, vmd_bool_t *sha_ok);
+/* number of threads used to parse the tracks of imported files, 1 by default */
+void         vmd_set_import_threads(int);
 
 /* export.c */
 
 vmd_status_t vmd_file_export_f(vmd_file_t *, FILE *);
+/* *data is malloc()ed, the caller frees it */
+vmd_status_t vmd_file_export_mem(vmd_file_t *, void **data, size_t *size);
 
 /* play.c */
 
@@ -304,6 +400,48 @@ typedef vmd_status_t (*vmd_delay_clb_t)(vmd_time_t delay, int tempo, void *);
 
 vmd_status_t vmd_file_play(vmd_file_t *, vmd_time_t, vmd_event_clb_t, vmd_delay_clb_t, void *, vmd_play_ctx_t **);
 
+/* player.c */
+
+/*
+ * plays a file in real time on threads of its own. events go to the callback
+ * from the player's timer thread, or to vmd_output() if it's NULL. needs
+ * pthreads and clock_nanosleep(), vmd_player_create() returns NULL otherwise.
+ *
+ * the player plays a copy of the file taken by vmd_player_start() (and
+ * vmd_player_seek()), so the file may be edited while it plays; edits are
+ * heard once the file is published with vmd_player_publish(), the player
+ * moves over to the newest copy at the next tick.
+ */
+
+struct vmd_player_stats_t {
+	unsigned long events;
+	unsigned long late;        /* output more than 1ms after they were due */
+	vmd_systime_t jitter_avg;  /* mean |output time - due time| */
+	vmd_systime_t jitter_max;
+};
+
+vmd_player_t *vmd_player_create(vmd_file_t *, vmd_event_clb_t, void *);
+void          vmd_player_destroy(vmd_player_t *);
+/*
+ * copies the file as it is now for the player to move over to. only what
+ * changed since the last publish is copied again, as far as vmd_file_commit()
+ * tells: channels edited since the last commit are always copied
+ */
+vmd_status_t  vmd_player_publish(vmd_player_t *);
+vmd_status_t  vmd_player_start(vmd_player_t *);
+void          vmd_player_stop(vmd_player_t *);
+vmd_bool_t    vmd_player_playing(vmd_player_t *);
+vmd_status_t  vmd_player_seek(vmd_player_t *, vmd_time_t);
+vmd_time_t    vmd_player_position(vmd_player_t *);
+/* 2 plays twice as fast; takes effect within the lookahead */
+void          vmd_player_set_tempo_scale(vmd_player_t *, double);
+/* how far ahead events are rendered (or fed to the device, if it can
+ * schedule them, see vmd_output_at()), 100ms by default */
+void          vmd_player_set_lookahead(vmd_player_t *, vmd_systime_t);
+/* counted since the last start; with a scheduling device, jitter and lateness
+ * are those of handing the events over */
+void          vmd_player_stats(vmd_player_t *, vmd_player_stats_t *);
+
 /* note.c */
 
 struct vmd_note_t {
@@ -359,9 +497,11 @@ struct vmd_track_t {
 
 	vmd_chanmask_t   chanmask;
 	int              channel_usage[VMD_CHANNELS];
+	int              temp_notes; /* in temp_channels, i.e. not flattened yet */
 	vmd_channel_t   *temp_channels;
 	vmd_track_t     *next;
 	int              primary_ctrl_value[VMD_CCTRLS];
+	vmd_pitch_index_t *pitch_index;
 
 	const char      *name;
 };
@@ -379,11 +519,38 @@ vmd_track_t *vmd_track_create(vmd_file_t *file, vmd_chanmask_t chanmask);
 VMD_DEFINE_DESTROY(track) // vmd_track_destroy
 
 void *      vmd_track_for_range(vmd_track_t *, vmd_time_t, vmd_time_t, vmd_note_callback_t, void *);
+/* links the notes through note->next */
 vmd_note_t *vmd_track_range(vmd_track_t *, vmd_time_t, vmd_time_t, vmd_pitch_t, vmd_pitch_t);
+
+/*
+ * the notes sounding within [s, e) with pitches within [p_beg, p_end), found
+ * without changing anything, so several threads may look at a track at once
+ * (as long as none modifies it)
+ */
+
+#define VMD_RANGE_DEPTH 64
+
+struct vmd_track_range_iter_t {
+	vmd_time_t      s, e;
+	vmd_pitch_t     p_beg, p_end;
+	int             depth;
+	vmd_bst_node_t *stack[VMD_RANGE_DEPTH];
+};
+
+void        vmd_track_range_begin(vmd_track_range_iter_t *, vmd_track_t *, vmd_time_t s, vmd_time_t e, vmd_pitch_t p_beg, vmd_pitch_t p_end);
+/* NULL when there are no more */
+vmd_note_t *vmd_track_range_next(vmd_track_range_iter_t *);
+/* stores up to cap notes into out (in no particular order), returns how many
+ * there are; uses the pitch index, if there is one */
+size_t      vmd_track_range_into(vmd_track_t *, vmd_time_t s, vmd_time_t e, vmd_pitch_t p_beg, vmd_pitch_t p_end, vmd_note_t **out, size_t cap);
 vmd_note_t *vmd_track_insert(vmd_track_t *, vmd_time_t, vmd_time_t, vmd_pitch_t);
 
 vmd_note_t *vmd_track_note(vmd_bst_node_t *node);
 
+/* an index of notes by pitch speeds up vmd_track_range_into() over narrow
+ * pitch bands, at the cost of memory and slower note changes */
+vmd_status_t    vmd_track_index_pitches(vmd_track_t *, vmd_bool_t);
+
 vmd_bool_t      vmd_track_is_drums(const vmd_track_t *);
 vmd_time_t      vmd_track_length(const vmd_track_t *);
 int             vmd_track_idx(const vmd_track_t *);
@@ -393,7 +560,12 @@ void            vmd_track_set_notesystem(vmd_track_t *, vmd_notesystem_t);
 
 vmd_systime_t   vmd_systime(void);
 void            vmd_sleep(vmd_systime_t);
+/* sleeps till the last moments before the time and busy-waits the rest */
 void            vmd_sleep_till(vmd_systime_t);
+/* how long vmd_sleep_till() busy-waits at most; measured on first use,
+ * unless set. a negative value makes it measure again */
+void            vmd_set_sleep_slack(vmd_systime_t);
+vmd_systime_t   vmd_sleep_slack(void);
 
 enum {
 	VMD_INPUT_DEVICE,
@@ -408,8 +580,32 @@ vmd_status_t    vmd_set_device(int type, const char *);
 
 //              vmd_input
 void            vmd_output(const unsigned char *, size_t);
+/* outputs n events at once, cheaper than n vmd_output() calls */
+void            vmd_output_batch(const unsigned char *const *, const size_t *, size_t n);
+/* whether the output device can deliver events at a given time by itself */
+vmd_bool_t      vmd_can_output_at(void);
+/* schedules the event to be delivered at t (see vmd_systime()) */
+vmd_status_t    vmd_output_at(const unsigned char *, size_t, vmd_systime_t t);
+/* discards the events scheduled but not delivered yet */
+void            vmd_drop_output(void);
 void            vmd_flush_output(void);
 
+/*
+ * besides real devices, there are "null/", which only counts what it gets,
+ * and "capture/<path>", which records the events with the time they came at
+ * into a file (see hal_capture.c)
+ */
+
+struct vmd_null_stats_t {
+	unsigned long events;
+	unsigned long batches;     /* vmd_output_batch() calls */
+	unsigned long flushes;
+	vmd_systime_t first, last; /* when the first and the last event came */
+};
+
+/* counted since null/ was set, read it while nothing is being output */
+void            vmd_null_stats(vmd_null_stats_t *);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
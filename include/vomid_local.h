@@ -11,13 +11,17 @@
 #include "vomid_shortnames.h"
 
 typedef unsigned char uchar;
+typedef struct vmd_buf_t vmd_buf_t;
 typedef struct vmd_channel_rev_t vmd_channel_rev_t;
+typedef struct vmd_bst_diff_t vmd_bst_diff_t;
 typedef struct vmd_track_note_t vmd_track_note_t;
 typedef struct vmd_track_rev_t vmd_track_rev_t;
+typedef struct vmd_pitch_bucket_t vmd_pitch_bucket_t;
 typedef struct vmd_platform_t vmd_platform_t;
 typedef struct vmd_small_event_t vmd_small_event_t;
 
 #define VMD_SHA1_SIZE 20
+#define VMD_HASH64_SIZE 8
 
 /* midi stuff */
 
@@ -47,7 +51,8 @@ enum {
 enum {
 	VMD_PROPR_NOTESYSTEM,
 	VMD_PROPR_PITCH,
-	VMD_PROPR_SHA
+	VMD_PROPR_SHA,
+	VMD_PROPR_HASH64
 };
 
 /* midi.c */
@@ -55,7 +60,7 @@ enum {
 struct vmd_ctrl_info_t {
 	const char  *name;
 	int          default_value;
-	int  (*read)(unsigned char *buf, int size); /* used only for metas */
+	int  (*read)(const unsigned char *buf, int size); /* used only for metas */
 	void (*write)(vmd_small_event_t *ev, int channel, int type, int value);
 };
 
@@ -78,15 +83,16 @@ void vmd_midi_write_noteon(small_event_t *ev, note_t *note);
 void vmd_midi_write_noteoff(small_event_t *ev, note_t *note);
 void vmd_midi_write_meta(small_event_t *ev, uchar type, const uchar *data, int len);
 
-void vmd_midi_fwrite_varlen(FILE *out, time_t time);
-void vmd_midi_fwrite_meta_header(FILE *out, uchar type, int len);
-void vmd_midi_fwrite_meta(FILE *out, uchar type, const uchar *data, int len);
-void vmd_midi_fwrite_propr(FILE *out, uchar type, uchar *data, int s);
-void vmd_midi_fwrite_notesystem(FILE *out, const notesystem_t *);
-void vmd_midi_fwrite_pitch(FILE *out, pitch_t);
+void vmd_midi_bwrite_varlen(vmd_buf_t *out, time_t time);
+void vmd_midi_bwrite_meta_header(vmd_buf_t *out, uchar type, int len);
+void vmd_midi_bwrite_meta(vmd_buf_t *out, uchar type, const uchar *data, int len);
+void vmd_midi_bwrite_propr(vmd_buf_t *out, uchar type, const uchar *data, int s);
+void vmd_midi_bwrite_notesystem(vmd_buf_t *out, const notesystem_t *);
+void vmd_midi_bwrite_pitch(vmd_buf_t *out, pitch_t);
 
 extern const uchar vmd_midi_eot[3];
 
+#define CHUNK_HEADER_SIZE 8
 #define META_HEADER_SIZE 3
 #define PROPR_HEADER_SIZE (sizeof(vmd_magic_vomid) + 1)
 
@@ -121,6 +127,54 @@ extern const uchar vmd_midi_eot[3];
 		return a - b; \
 } while(0)
 
+/* bitmaps of VMD_BITMAP_WORDS(bits) words */
+static inline int
+vmd_lowest_bit(uint64_t w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	int ret = 0;
+	while (!(w & 1)) {
+		w >>= 1;
+		ret++;
+	}
+	return ret;
+#endif
+}
+
+/* iterates over the bits set in a bitmap of the given length */
+#define VMD_FOREACH_BIT(i, bitmap, bits) \
+	for (int _w_ = 0; _w_ < VMD_BITMAP_WORDS(bits); _w_++) \
+		for (uint64_t _b_ = (bitmap)[_w_]; _b_ != 0 && ((i) = _w_ * 64 + vmd_lowest_bit(_b_), 1); _b_ &= _b_ - 1)
+
+/* buf.c */
+
+/* growable byte buffer; once an allocation fails, further writes are dropped */
+struct vmd_buf_t {
+	unsigned char *data;
+	size_t size, max_size;
+	vmd_bool_t failed;
+};
+
+void            vmd_buf_init(vmd_buf_t *);
+void            vmd_buf_fini(vmd_buf_t *);
+void *          vmd_buf_grow(vmd_buf_t *, size_t); /* appends size bytes, returns them */
+void            vmd_buf_write(vmd_buf_t *, const void *, size_t);
+void            vmd_buf_putc(vmd_buf_t *, int);
+
+/* hash64.c */
+
+typedef struct vmd_hash64_t {
+	uint64_t h;
+	uint64_t len;
+	unsigned char tail[8];
+} vmd_hash64_t;
+
+void            vmd_hash64_init(vmd_hash64_t *);
+void            vmd_hash64_update(vmd_hash64_t *, const void *, size_t);
+void            vmd_hash64_final(vmd_hash64_t *, unsigned char digest[VMD_HASH64_SIZE]);
+
 /* stack.c */
 
 typedef struct vmd_stack_t {
@@ -153,6 +207,8 @@ vmd_notesystem_t vmd_notesystem_import_f(FILE *);
 /* channel.c */
 
 struct vmd_channel_rev_t {
+	int refs; /* file revisions sharing it */
+	unsigned long serial; /* unlike the address, never reused */
 	vmd_bst_rev_t *notes;
 	vmd_bst_rev_t *ctrl[VMD_CCTRLS];
 };
@@ -164,9 +220,14 @@ vmd_channel_t *vmd_channel_create(int number);
 VMD_DEFINE_DESTROY(channel) // vmd_channel_destroy
 
 void *      vmd_channel_range(vmd_channel_t *, vmd_time_t, vmd_time_t, vmd_note_callback_t, void *);
+vmd_map_t * vmd_channel_ctrl(vmd_channel_t *, int ctrl);
+void        vmd_channel_copy_ctrls(vmd_channel_t *, vmd_time_t, vmd_time_t, vmd_channel_t *, vmd_time_t);
 
 void        vmd_channel_commit(vmd_channel_t *, vmd_channel_rev_t *);
 void        vmd_channel_update(vmd_channel_t *, vmd_channel_rev_t *);
+void        vmd_channel_prune(vmd_channel_t *, vmd_channel_rev_t **keep, int n);
+size_t      vmd_channel_history_size(vmd_channel_t *);
+vmd_bool_t  vmd_channel_dirty(vmd_channel_t *);
 
 vmd_note_t *vmd_channel_note(vmd_bst_node_t *node);
 
@@ -178,27 +239,63 @@ struct vmd_track_note_t {
 };
 
 struct vmd_track_rev_t {
+	int refs; /* file revisions sharing it */
 	vmd_bst_rev_t *notes;
 	const char *name;
 	int primary_ctrl_value[VMD_CCTRLS];
 };
 
 vmd_status_t        vmd_track_flatten(vmd_track_t *);
+/* keep track->pitch_index in step, called by insert_note() and friends */
+void                vmd_track_note_added(vmd_track_t *, vmd_note_t *);
+void                vmd_track_note_removed(vmd_track_t *, vmd_note_t *);
 vmd_channel_t *     vmd_track_temp_channel(vmd_track_t *, vmd_time_t, vmd_time_t, vmd_note_t *);
 
 void                vmd_track_commit(vmd_track_t *, vmd_track_rev_t *);
+vmd_bool_t          vmd_track_dirty(vmd_track_t *, vmd_track_rev_t *);
 void                vmd_track_update(vmd_track_t *, vmd_track_rev_t *);
+void                vmd_track_prune(vmd_track_t *, vmd_track_rev_t **keep, int n);
+
+/* pitch_index.c */
+
+struct vmd_pitch_index_t {
+	vmd_pitch_t beg;
+	int size;
+	vmd_pitch_bucket_t *bucket; /* [pitch - beg] */
+	vmd_bool_t stale;           /* missed some changes, don't use it */
+};
+
+void         vmd_pitch_index_init(vmd_pitch_index_t *);
+void         vmd_pitch_index_fini(vmd_pitch_index_t *);
+vmd_status_t vmd_pitch_index_add(vmd_pitch_index_t *, vmd_note_t *);
+void         vmd_pitch_index_remove(vmd_pitch_index_t *, vmd_note_t *);
+size_t       vmd_pitch_index_range(vmd_pitch_index_t *, vmd_time_t s, vmd_time_t e,
+				vmd_pitch_t p_beg, vmd_pitch_t p_end, vmd_note_t **out, size_t cap);
 
 /* file.c */
 
+typedef struct vmd_fctrl_rev_t {
+	int refs; /* file revisions sharing it */
+	unsigned long serial; /* unlike the address, never reused */
+	vmd_bst_rev_t *ctrl[VMD_FCTRLS];
+} vmd_fctrl_rev_t;
+
+/* parts that didn't change are shared with the previous revision */
 struct vmd_file_rev_t {
+	vmd_file_rev_t *next; /* committed before this one */
+	vmd_bool_t keep;      /* mark for vmd_file_prune() */
+	vmd_channel_rev_t *channel[VMD_CHANNELS];
+	vmd_fctrl_rev_t *ctrl;
 	int tracks;
-	vmd_track_t *track[VMD_MAX_TRACKS];
-	vmd_track_rev_t track_rev[VMD_MAX_TRACKS];
-	vmd_channel_rev_t channel[VMD_CHANNELS];
-	vmd_bst_rev_t *ctrl[VMD_FCTRLS];
+	struct {
+		vmd_track_t *track;
+		vmd_track_rev_t *rev;
+	} track[];
 };
 
+void vmd_file_regen_measure_index(vmd_file_t *);
+unsigned long vmd_file_serial(vmd_file_t *, int channel);
+
 /* play.c */
 
 typedef void         (*vmd_tevent_clb_t)(int track, vmd_small_event_t *ev, void *arg);
@@ -207,17 +304,45 @@ typedef void         (*vmd_note_clb_t)(const note_t *note, void *arg);
 
 vmd_status_t         vmd_file_play_(vmd_file_t *file, vmd_time_t time, vmd_tevent_clb_t voice_clb,
 						vmd_dtime_clb_t dtime_clb, vmd_note_clb_t note_clb, void *arg, vmd_play_ctx_t **pctx);
+vmd_status_t         vmd_file_play_channel(vmd_file_t *file, int channel, vmd_tevent_clb_t voice_clb,
+						vmd_dtime_clb_t dtime_clb, void *arg);
+
+/* player.c */
+
+/* for tests: plays on up to until without threads or waiting */
+vmd_status_t vmd_player_step(vmd_player_t *, vmd_time_t until);
 
 /* bst.c */
 
+/* what happened to each node between two revisions */
+struct vmd_bst_diff_t {
+	int count;
+	vmd_bst_node_t **node;
+	unsigned char *in;    /* VMD_BST_IN_BEFORE | VMD_BST_IN_AFTER */
+	char *before, *after; /* node data on either side, count * csize bytes */
+};
+
+enum {
+	VMD_BST_IN_BEFORE = 1,
+	VMD_BST_IN_AFTER = 2
+};
+
 struct vmd_bst_rev_t {
 	vmd_bst_rev_t *parent;
 	vmd_bst_rev_t *brother;
 	vmd_bst_rev_t *child;
+	int level; /* distance to the root */
 
-	int inserted_count, erased_count, changed_count;
-	vmd_bst_node_t **inserted, **erased, **changed;
-	void *uninserted_data, *erased_data, *changed_data;
+	vmd_bst_diff_t diff; /* from the parent */
+
+	/*
+	 * skip pointer to an ancestor, laid out so that any ancestor is
+	 * O(log(level)) jumps away, and the diff from it unless it's the parent
+	 */
+	vmd_bst_rev_t *jump;
+	vmd_bst_diff_t jump_diff;
+
+	unsigned char keep, needed; /* marks for vmd_bst_prune() */
 };
 
 static inline vmd_bst_node_t *
@@ -264,6 +389,9 @@ struct vmd_platform_t {
 	void (*enum_devices)(int type, vmd_device_clb_t, void *);
 	vmd_status_t (*set_device)(int, const char *);
 	void (*output)(const uchar *, size_t);
+	void (*output_batch)(const uchar *const *, const size_t *, size_t); /* voice events only */
+	void (*output_at)(const uchar *, size_t, vmd_systime_t); /* delivered at vmd_systime() */
+	void (*drop_output)(); /* cancels what output_at() has scheduled */
 	void (*flush_output)();
 	const char *name;
 	vmd_bool_t initialized;
@@ -271,7 +399,12 @@ struct vmd_platform_t {
 	vmd_platform_t *next;
 };
 
+/* sleeps till about t, defined by hal_<system>.c along with vmd_sleep() */
+void vmd_sleep_abs(vmd_systime_t t);
+
 extern vmd_platform_t vmd_platform_alsa;
+extern vmd_platform_t vmd_platform_capture;
+extern vmd_platform_t vmd_platform_null;
 extern vmd_platform_t vmd_platform_win32;
 
 #endif /* VOMID_LOCAL_H_INCLUDED */
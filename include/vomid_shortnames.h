@@ -1,3 +1,4 @@
+#define BITMAP_WORDS VMD_BITMAP_WORDS
 #define BLOG VMD_BLOG
 #define BLOG16 VMD_BLOG16
 #define BLOG2 VMD_BLOG2
@@ -5,6 +6,8 @@
 #define BLOG4 VMD_BLOG4
 #define BLOG8 VMD_BLOG8
 #define BST_FOREACH VMD_BST_FOREACH
+#define BST_IN_AFTER VMD_BST_IN_AFTER
+#define BST_IN_BEFORE VMD_BST_IN_BEFORE
 #define CCTRLS VMD_CCTRLS
 #define CCTRL_BALANCE VMD_CCTRL_BALANCE
 #define CCTRL_EXPRESSION VMD_CCTRL_EXPRESSION
@@ -16,6 +19,8 @@
 #define CHANMASK_DRUMS VMD_CHANMASK_DRUMS
 #define CHANMASK_NODRUMS VMD_CHANMASK_NODRUMS
 #define CHANNELS VMD_CHANNELS
+#define CHECKSUM_HASH64 VMD_CHECKSUM_HASH64
+#define CHECKSUM_SHA1 VMD_CHECKSUM_SHA1
 #define CMP VMD_CMP
 #define CTRLS VMD_CTRLS
 #define CTRL_CONTROLLERS_OFF VMD_CTRL_CONTROLLERS_OFF
@@ -32,6 +37,8 @@
 #define FCTRLS VMD_FCTRLS
 #define FCTRL_TEMPO VMD_FCTRL_TEMPO
 #define FCTRL_TIMESIG VMD_FCTRL_TIMESIG
+#define FOREACH_BIT VMD_FOREACH_BIT
+#define HASH64_SIZE VMD_HASH64_SIZE
 #define INPUT_DEVICE VMD_INPUT_DEVICE
 #define JOIN VMD_JOIN
 #define JOIN3 VMD_JOIN3
@@ -52,10 +59,13 @@
 #define NOTES VMD_NOTES
 #define OK VMD_OK
 #define OUTPUT_DEVICE VMD_OUTPUT_DEVICE
+#define PBST_MAX_HEIGHT VMD_PBST_MAX_HEIGHT
 #define PROGRAMS VMD_PROGRAMS
+#define PROPR_HASH64 VMD_PROPR_HASH64
 #define PROPR_NOTESYSTEM VMD_PROPR_NOTESYSTEM
 #define PROPR_PITCH VMD_PROPR_PITCH
 #define PROPR_SHA VMD_PROPR_SHA
+#define RANGE_DEPTH VMD_RANGE_DEPTH
 #define SHA1_SIZE VMD_SHA1_SIZE
 #define STOP VMD_STOP
 #define STRINGIFY VMD_STRINGIFY
@@ -74,18 +84,24 @@
 #define VOICE_PITCHWHEEL VMD_VOICE_PITCHWHEEL
 #define VOICE_PROGRAM VMD_VOICE_PROGRAM
 #define bool_t vmd_bool_t
+#define bst_append_sorted vmd_bst_append_sorted
 #define bst_begin vmd_bst_begin
+#define bst_block_t vmd_bst_block_t
 #define bst_bound vmd_bst_bound
+#define bst_build_sorted vmd_bst_build_sorted
 #define bst_change vmd_bst_change
 #define bst_clear vmd_bst_clear
 #define bst_cmp_t vmd_bst_cmp_t
 #define bst_commit vmd_bst_commit
+#define bst_diff_t vmd_bst_diff_t
+#define bst_dirty vmd_bst_dirty
 #define bst_empty vmd_bst_empty
 #define bst_end vmd_bst_end
 #define bst_erase vmd_bst_erase
 #define bst_erase_range vmd_bst_erase_range
 #define bst_find vmd_bst_find
 #define bst_fini vmd_bst_fini
+#define bst_history_size vmd_bst_history_size
 #define bst_init vmd_bst_init
 #define bst_insert vmd_bst_insert
 #define bst_lower_bound vmd_bst_lower_bound
@@ -100,6 +116,7 @@
 #define bst_node_rightmost vmd_bst_node_rightmost
 #define bst_node_t vmd_bst_node_t
 #define bst_prev vmd_bst_prev
+#define bst_prune vmd_bst_prune
 #define bst_rev_t vmd_bst_rev_t
 #define bst_revert vmd_bst_revert
 #define bst_root vmd_bst_root
@@ -108,14 +125,26 @@
 #define bst_upd_t vmd_bst_upd_t
 #define bst_update vmd_bst_update
 #define bst_upper_bound vmd_bst_upper_bound
+#define buf_fini vmd_buf_fini
+#define buf_grow vmd_buf_grow
+#define buf_init vmd_buf_init
+#define buf_putc vmd_buf_putc
+#define buf_t vmd_buf_t
+#define buf_write vmd_buf_write
+#define can_output_at vmd_can_output_at
 #define cctrl_info vmd_cctrl_info
 #define chanmask_t vmd_chanmask_t
 #define channel_commit vmd_channel_commit
+#define channel_copy_ctrls vmd_channel_copy_ctrls
 #define channel_create vmd_channel_create
+#define channel_ctrl vmd_channel_ctrl
 #define channel_destroy vmd_channel_destroy
+#define channel_dirty vmd_channel_dirty
 #define channel_fini vmd_channel_fini
+#define channel_history_size vmd_channel_history_size
 #define channel_init vmd_channel_init
 #define channel_note vmd_channel_note
+#define channel_prune vmd_channel_prune
 #define channel_range vmd_channel_range
 #define channel_rev_t vmd_channel_rev_t
 #define channel_t vmd_channel_t
@@ -124,20 +153,26 @@
 #define ctrl_info_t vmd_ctrl_info_t
 #define delay_clb_t vmd_delay_clb_t
 #define device_clb_t vmd_device_clb_t
+#define drop_output vmd_drop_output
 #define dtime_clb_t vmd_dtime_clb_t
 #define enum_devices vmd_enum_devices
 #define erase_note vmd_erase_note
 #define erase_notes vmd_erase_notes
 #define event_clb_t vmd_event_clb_t
 #define fctrl_info vmd_fctrl_info
+#define fctrl_rev_t vmd_fctrl_rev_t
 #define file_commit vmd_file_commit
 #define file_copy_string vmd_file_copy_string
 #define file_export vmd_file_export
 #define file_export_f vmd_file_export_f
+#define file_export_mem vmd_file_export_mem
 #define file_fini vmd_file_fini
 #define file_flatten vmd_file_flatten
+#define file_history_size vmd_file_history_size
 #define file_import vmd_file_import
 #define file_import_f vmd_file_import_f
+#define file_import_mem vmd_file_import_mem
+#define file_import_mmap vmd_file_import_mmap
 #define file_init vmd_file_init
 #define file_is_compatible vmd_file_is_compatible
 #define file_length vmd_file_length
@@ -146,14 +181,23 @@
 #define file_measures vmd_file_measures
 #define file_play vmd_file_play
 #define file_play_ vmd_file_play_
+#define file_play_channel vmd_file_play_channel
+#define file_prune vmd_file_prune
+#define file_regen_measure_index vmd_file_regen_measure_index
 #define file_rev_t vmd_file_rev_t
+#define file_serial vmd_file_serial
 #define file_t vmd_file_t
 #define file_update vmd_file_update
 #define flush_output vmd_flush_output
 #define gm_program_name vmd_gm_program_name
+#define hash64_final vmd_hash64_final
+#define hash64_init vmd_hash64_init
+#define hash64_t vmd_hash64_t
+#define hash64_update vmd_hash64_update
 #define input vmd_input
 #define insert_note vmd_insert_note
 #define isolate_note vmd_isolate_note
+#define lowest_bit vmd_lowest_bit
 #define magic_mthd vmd_magic_mthd
 #define magic_mtrk vmd_magic_mtrk
 #define magic_vomid vmd_magic_vomid
@@ -171,16 +215,17 @@
 #define map_set_range vmd_map_set_range
 #define map_t vmd_map_t
 #define map_time vmd_map_time
+#define map_track_usage vmd_map_track_usage
 #define map_value vmd_map_value
 #define measure_clb_t vmd_measure_clb_t
 #define measure_t vmd_measure_t
+#define midi_bwrite_meta vmd_midi_bwrite_meta
+#define midi_bwrite_meta_header vmd_midi_bwrite_meta_header
+#define midi_bwrite_notesystem vmd_midi_bwrite_notesystem
+#define midi_bwrite_pitch vmd_midi_bwrite_pitch
+#define midi_bwrite_propr vmd_midi_bwrite_propr
+#define midi_bwrite_varlen vmd_midi_bwrite_varlen
 #define midi_eot vmd_midi_eot
-#define midi_fwrite_meta vmd_midi_fwrite_meta
-#define midi_fwrite_meta_header vmd_midi_fwrite_meta_header
-#define midi_fwrite_notesystem vmd_midi_fwrite_notesystem
-#define midi_fwrite_pitch vmd_midi_fwrite_pitch
-#define midi_fwrite_propr vmd_midi_fwrite_propr
-#define midi_fwrite_varlen vmd_midi_fwrite_varlen
 #define midi_write_meta vmd_midi_write_meta
 #define midi_write_noteoff vmd_midi_write_noteoff
 #define midi_write_noteon vmd_midi_write_noteon
@@ -204,13 +249,53 @@
 #define notesystem_pitch2level vmd_notesystem_pitch2level
 #define notesystem_t vmd_notesystem_t
 #define notesystem_tet vmd_notesystem_tet
+#define null_stats vmd_null_stats
+#define null_stats_t vmd_null_stats_t
 #define output vmd_output
+#define output_at vmd_output_at
+#define output_batch vmd_output_batch
+#define pbst_begin vmd_pbst_begin
+#define pbst_commit vmd_pbst_commit
+#define pbst_erase vmd_pbst_erase
+#define pbst_find vmd_pbst_find
+#define pbst_fini vmd_pbst_fini
+#define pbst_init vmd_pbst_init
+#define pbst_insert vmd_pbst_insert
+#define pbst_iter_t vmd_pbst_iter_t
+#define pbst_lower_bound vmd_pbst_lower_bound
+#define pbst_next vmd_pbst_next
+#define pbst_node_t vmd_pbst_node_t
+#define pbst_release vmd_pbst_release
+#define pbst_t vmd_pbst_t
+#define pitch_bucket_t vmd_pitch_bucket_t
+#define pitch_index_add vmd_pitch_index_add
+#define pitch_index_fini vmd_pitch_index_fini
+#define pitch_index_init vmd_pitch_index_init
+#define pitch_index_range vmd_pitch_index_range
+#define pitch_index_remove vmd_pitch_index_remove
+#define pitch_index_t vmd_pitch_index_t
 #define pitch_info vmd_pitch_info
 #define pitch_t vmd_pitch_t
 #define platform_alsa vmd_platform_alsa
+#define platform_capture vmd_platform_capture
+#define platform_null vmd_platform_null
 #define platform_t vmd_platform_t
 #define platform_win32 vmd_platform_win32
 #define play_ctx_t vmd_play_ctx_t
+#define player_create vmd_player_create
+#define player_destroy vmd_player_destroy
+#define player_playing vmd_player_playing
+#define player_position vmd_player_position
+#define player_publish vmd_player_publish
+#define player_seek vmd_player_seek
+#define player_set_lookahead vmd_player_set_lookahead
+#define player_set_tempo_scale vmd_player_set_tempo_scale
+#define player_start vmd_player_start
+#define player_stats vmd_player_stats
+#define player_stats_t vmd_player_stats_t
+#define player_step vmd_player_step
+#define player_stop vmd_player_stop
+#define player_t vmd_player_t
 #define pool_alloc vmd_pool_alloc
 #define pool_chunk_t vmd_pool_chunk_t
 #define pool_fini vmd_pool_fini
@@ -220,7 +305,11 @@
 #define rendersystem_t vmd_rendersystem_t
 #define reset_output vmd_reset_output
 #define set_device vmd_set_device
+#define set_import_threads vmd_set_import_threads
+#define set_sleep_slack vmd_set_sleep_slack
 #define sleep vmd_sleep
+#define sleep_abs vmd_sleep_abs
+#define sleep_slack vmd_sleep_slack
 #define sleep_till vmd_sleep_till
 #define small_event_t vmd_small_event_t
 #define stack_block_t vmd_stack_block_t
@@ -240,18 +329,27 @@
 #define track_commit vmd_track_commit
 #define track_create vmd_track_create
 #define track_destroy vmd_track_destroy
+#define track_dirty vmd_track_dirty
 #define track_fini vmd_track_fini
 #define track_flatten vmd_track_flatten
 #define track_for_range vmd_track_for_range
 #define track_get_ctrl vmd_track_get_ctrl
 #define track_idx vmd_track_idx
+#define track_index_pitches vmd_track_index_pitches
 #define track_init vmd_track_init
 #define track_insert vmd_track_insert
 #define track_is_drums vmd_track_is_drums
 #define track_length vmd_track_length
 #define track_note vmd_track_note
+#define track_note_added vmd_track_note_added
+#define track_note_removed vmd_track_note_removed
 #define track_note_t vmd_track_note_t
+#define track_prune vmd_track_prune
 #define track_range vmd_track_range
+#define track_range_begin vmd_track_range_begin
+#define track_range_into vmd_track_range_into
+#define track_range_iter_t vmd_track_range_iter_t
+#define track_range_next vmd_track_range_next
 #define track_rev_t vmd_track_rev_t
 #define track_set_ctrl vmd_track_set_ctrl
 #define track_set_notesystem vmd_track_set_notesystem
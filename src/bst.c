@@ -19,34 +19,60 @@
  * - erased nodes are reused only after committing
  * @par Implementation notes
  * - all write operations are implemented in terms of inserting and erasing.
- *   inserted/erased notes get tracked, and at commit time, data from erased nodes
- *   get bundled and stored in rev. erased nodes go to the free nodes pool.
- *   revs are essentially diffs. when updating, the path from current revision to needed one
- *   is traversed, and revs on it are "toggled" - reversed and applied. it's slow, but
- *   I use it for undo/redo, so in most cases only 1 rev is toggled.
- *   bst/update test is horribly slow, though.
+ *   inserted/erased/changed nodes get tracked, and at commit time, the node data
+ *   on both sides of the change gets bundled into the rev's diff. erased nodes go
+ *   to the free nodes pool. when updating, the path from current revision to needed one
+ *   is traversed, applying the "before" side of diffs on the way up to the common
+ *   ancestor and the "after" side on the way down. this only marks the nodes;
+ *   each of them is then moved in the tree once, with its final data.
+ * - every rev also has a skip pointer ("jump") to an ancestor, with the diffs in
+ *   between composed into one. jumps follow the skew-binary scheme, so any ancestor
+ *   is O(log(distance)) jumps away, and long undos go across a few composed diffs
+ *   instead of every rev in between. nodes that end up where they started
+ *   cancel out of a composed diff.
  * - more about performance when snapshots are used:
  *   there's practically no overhead to insert/erase.
  *   first commit() is free.
- *   commit() is O(inserted + erased)
- *   toggle() is O((i + e) * log(allnodes)). Just like manual inserting&erasing to needed state.
+ *   commit() is O(inserted + erased + changed), plus composing the jump diff
+ *   (amortized O(log(revs)) per changed node).
+ *   update() is O(log(distance) * changed + n * log(allnodes)), n being the nodes
+ *   that differ between the two revisions.
  * - memory usage:
- *   let's make a commit, I times insert(), E times erase(), and again commit:
+ *   let's make a commit, I times insert(), E times erase(), C times change(), and commit:
  *   initial commit is free.
- *   second committing will alloc (I+E)*sizeof(void *) + E*tree->csize bytes
- *   updating back to initial commit will alloc I*tree->csize bytes.
- *   later updating back and forth will be free.
+ *   the diff takes (I+E+C)*(sizeof(void *) + 1 + 2*tree->csize) bytes.
+ *   the composed jump diffs take about as much again per level of the skip pointers,
+ *   so O(log(revs)) times the plain diffs in total.
+ *   updating back and forth is free.
  *   nodes are never freed, and always reused after committing.
+ * - node allocation:
+ *   nodes are carved out of per-tree blocks, which grow geometrically
+ *   (MIN_BLOCK_NODES, doubling up to MAX_BLOCK_NODES nodes per block),
+ *   so small trees (most of the controller maps) stay small and large ones
+ *   don't hit malloc() on every insert. blocks are released in bulk by bst_fini().
  *
  * most of the things above are about once committed tree. if you don't use snapshots,
  * it will perform just like a plain AVL tree implementation, without any overhead.
  */
 
+#include <stdlib.h>
+#include <stdint.h> /* uintptr_t */
 #include <memory.h>
 #include <stddef.h> /* offsetof */
 #include <assert.h>
 #include "vomid_local.h"
 
+#define MIN_BLOCK_NODES 4
+#define MAX_BLOCK_NODES 1024
+
+typedef struct bst_block_t bst_block_t;
+
+struct bst_block_t {
+	bst_block_t *next;
+	size_t nodes;
+	char data[];
+};
+
 /* intrusive single-linked list of nodes */
 
 static int
@@ -258,13 +284,32 @@ erase_node(bst_t *tree, bst_node_t *node)
 	return next;
 }
 
+/*
+ * restores the order after the node data has changed.
+ * if the node still fits between its neighbours, only the
+ * dynamic data on the path to the root is updated
+ */
+static void
+resort_node(bst_t *tree, bst_node_t *node)
+{
+	bst_node_t *prev = bst_node_prev(node);
+	bst_node_t *next = bst_node_next(node);
+
+	if ((bst_node_is_end(prev) || tree->cmp(prev->data, node->data) <= 0) &&
+	    (bst_node_is_end(next) || tree->cmp(node->data, next->data) <= 0)) {
+		update_to_top(tree, node);
+		return;
+	}
+
+	erase_node(tree, node);
+	insert_node(tree, node);
+}
+
 /* called in bst_erase() and bst_clear() */
 static void
 erased_node(bst_t *tree, bst_node_t *node)
 {
-	if (tree->tip == NULL)
-		free(node);
-	else if (node->inserted)
+	if (tree->tip == NULL || node->inserted)
 		dlist_insert(&tree->free, node);
 	else
 		slist_push(&tree->erased, node);
@@ -292,6 +337,7 @@ create_rev(bst_rev_t *parent)
 	rev->parent = parent;
 
 	if (parent != NULL) {
+		rev->level = parent->level + 1;
 		rev->brother = parent->child;
 		parent->child = rev;
 	}
@@ -300,53 +346,177 @@ create_rev(bst_rev_t *parent)
 }
 
 static void
-destroy_rev(bst_rev_t *rev)
+diff_alloc(bst_t *tree, bst_diff_t *diff, int count)
 {
-	free(rev->inserted);
-	free(rev->erased);
-	free(rev->changed);
-	free(rev->uninserted_data);
-	free(rev->erased_data);
-	free(rev->changed_data);
-	free(rev);
+	diff->count = count;
+	diff->node = malloc(count * sizeof(bst_node_t *));
+	diff->in = malloc(count);
+	diff->before = malloc(count * tree->csize);
+	diff->after = malloc(count * tree->csize);
 }
 
 static void
-destroy_revs(bst_rev_t *rev)
+diff_free(bst_diff_t *diff)
 {
-	if (rev == NULL)
+	free(diff->node);
+	free(diff->in);
+	free(diff->before);
+	free(diff->after);
+	memset(diff, 0, sizeof(*diff));
+}
+
+/* gives back the space past diff->count */
+static void
+diff_fit(bst_t *tree, bst_diff_t *diff)
+{
+	if (diff->count == 0) {
+		diff_free(diff);
 		return;
+	}
+	diff->node = realloc(diff->node, diff->count * sizeof(bst_node_t *));
+	diff->in = realloc(diff->in, diff->count);
+	diff->before = realloc(diff->before, diff->count * tree->csize);
+	diff->after = realloc(diff->after, diff->count * tree->csize);
+}
 
-	destroy_revs(rev->brother);
-	destroy_revs(rev->child);
+static size_t
+diff_size(bst_t *tree, bst_diff_t *diff)
+{
+	return diff->count * (sizeof(bst_node_t *) + 1 + 2 * tree->csize);
+}
 
-	destroy_rev(rev);
+static void
+destroy_rev(bst_rev_t *rev)
+{
+	diff_free(&rev->diff);
+	diff_free(&rev->jump_diff);
+	free(rev);
 }
 
+/*
+ * destroys rev, its brothers and all their descendants.
+ * rotates children up into the brother chain instead of recursing,
+ * since a linear history is as deep as it is long
+ */
 static void
-unfree_erased(bst_t *tree, bst_rev_t *rev)
+destroy_revs(bst_rev_t *rev)
 {
-	for (int i = 0; i < rev->erased_count; i++) {
-		dlist_erase(&tree->free, rev->erased[i]);
-		memcpy(rev->erased[i]->data, rev->erased_data + i * tree->csize, tree->csize);
+	while (rev != NULL) {
+		bst_rev_t *i = rev;
+
+		if (i->child == NULL) {
+			rev = i->brother;
+			destroy_rev(i);
+		} else {
+			rev = i->child;
+			i->child = rev->brother;
+			rev->brother = i;
+		}
 	}
 }
 
+/* preorder walk of the revisions under top */
+static bst_rev_t *
+next_rev(bst_rev_t *rev, bst_rev_t *top)
+{
+	if (rev->child != NULL)
+		return rev->child;
+	for (; rev != top; rev = rev->parent)
+		if (rev->brother != NULL)
+			return rev->brother;
+	return NULL;
+}
+
+static bst_rev_t *
+root_rev(bst_rev_t *rev)
+{
+	while (rev->jump != NULL)
+		rev = rev->jump;
+	return rev;
+}
+
+/* the diff between rev->jump and rev */
+static bst_diff_t *
+jump_diff(bst_rev_t *rev)
+{
+	return rev->jump == rev->parent ? &rev->diff : &rev->jump_diff;
+}
+
+typedef struct diff_entry_t {
+	bst_node_t *node;
+	int part, i;
+} diff_entry_t;
+
+static int
+diff_entry_cmp(const void *_a, const void *_b)
+{
+	const diff_entry_t *a = _a, *b = _b;
+
+	/* pointers don't fit in the int that CMP() returns */
+	if (a->node != b->node)
+		return (uintptr_t)a->node < (uintptr_t)b->node ? -1 : 1;
+	CMP(a->part, b->part);
+	return 0;
+}
+
+/*
+ * the diff of going through parts[0], ..., parts[n - 1] in a row.
+ * nodes that end up the way they started are left out
+ */
 static void
-free_erased(bst_t *tree, bst_rev_t *rev)
+diff_compose(bst_t *tree, bst_diff_t *ret, bst_diff_t **parts, int n)
 {
-	int i;
-	if (rev->erased == NULL)
-		return;
+	size_t cs = tree->csize;
+	int total = 0, p, i, j, k;
+
+	for (p = 0; p < n; p++)
+		total += parts[p]->count;
 
-	if (rev->erased_data == NULL) {
-		rev->erased_data = malloc(tree->csize * rev->erased_count);
-		for (i = 0; i < rev->erased_count; i++)
-			memcpy(rev->erased_data + i * tree->csize, rev->erased[i]->data, tree->csize);
+	diff_entry_t *e = malloc(total * sizeof(*e));
+	for (p = 0, k = 0; p < n; p++)
+		for (i = 0; i < parts[p]->count; i++)
+			e[k++] = (diff_entry_t){parts[p]->node[i], p, i};
+	qsort(e, total, sizeof(*e), diff_entry_cmp);
+
+	diff_alloc(tree, ret, total);
+	for (i = 0, k = 0; i < total; i = j) {
+		for (j = i + 1; j < total && e[j].node == e[i].node; j++)
+			;
+		bst_diff_t *first = parts[e[i].part], *last = parts[e[j - 1].part];
+		int fi = e[i].i, li = e[j - 1].i;
+		unsigned char in = (first->in[fi] & BST_IN_BEFORE) | (last->in[li] & BST_IN_AFTER);
+
+		if ((in == 0 || in == (BST_IN_BEFORE | BST_IN_AFTER)) &&
+		    (in == 0 || memcmp(first->before + fi * cs, last->after + li * cs, cs) == 0))
+			continue;
+
+		ret->node[k] = e[i].node;
+		ret->in[k] = in;
+		memcpy(ret->before + k * cs, first->before + fi * cs, cs);
+		memcpy(ret->after + k * cs, last->after + li * cs, cs);
+		k++;
 	}
+	ret->count = k;
+	diff_fit(tree, ret);
+	free(e);
+}
+
+/*
+ * skew-binary jumps (Myers, 1983): a jump either goes to the parent,
+ * or over two equal jumps in a row, so their lengths are 2^k - 1
+ */
+static void
+link_jump(bst_t *tree, bst_rev_t *rev)
+{
+	bst_rev_t *p = rev->parent;
 
-	for (i = 0; i < rev->erased_count; i++)
-		dlist_insert(&tree->free, rev->erased[i]);
+	if (p->jump != NULL && p->jump->jump != NULL &&
+	    p->level - p->jump->level == p->jump->level - p->jump->jump->level) {
+		rev->jump = p->jump->jump;
+		diff_compose(tree, &rev->jump_diff,
+			(bst_diff_t *[]){jump_diff(p->jump), jump_diff(p), &rev->diff}, 3);
+	} else
+		rev->jump = p;
 }
 
 bst_node_t *
@@ -385,27 +555,19 @@ bst_init(bst_t *tree, size_t dsize, size_t csize, bst_cmp_t cmp, bst_upd_t upd)
 	tree->head.parent = &tree->head;
 }
 
+/*
+ * all the nodes (in the tree, erased, free and saved ones) live in blocks,
+ * so there's no need to clear the tree or walk the lists
+ */
 void
 bst_fini(bst_t *tree)
 {
-	bst_clear(tree);
+	if (tree->tip != NULL)
+		destroy_revs(root_rev(tree->tip));
 
-	if (tree->tip != NULL) {
-		bst_commit(tree); //TODO: this is unnecessary
-
-		bst_rev_t *head;
-		for (head = tree->tip; head->parent != NULL; head = head->parent)
-			;
-		destroy_revs(head);
-	}
-
-	if (tree->free != NULL) {
-		bst_node_t *i = tree->free;
-		do {
-			bst_node_t *next = i->child[1];
-			free(i);
-			i = next;
-		} while (i != tree->free);
+	for (bst_block_t *i = tree->blocks, *next; i != NULL; i = next) {
+		next = i->next;
+		free(i);
 	}
 }
 
@@ -422,15 +584,37 @@ bst_clear(bst_t *tree)
 	tree->tree_size = 0;
 }
 
-static bst_node_t *
-create_node(bst_t *tree)
+static size_t
+node_size(bst_t *tree)
 {
-	size_t node_size = MAX(
+	size_t size = MAX(
 		sizeof(bst_node_t),
 		offsetof(bst_node_t, data[tree->dsize])
 	);
 
-	bst_node_t *ret = malloc(node_size);
+	/* keep the nodes in a block aligned */
+	return (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+static bst_node_t *
+create_node(bst_t *tree)
+{
+	size_t size = node_size(tree);
+
+	if (tree->block_free == 0) {
+		size_t nodes = tree->blocks == NULL ? MIN_BLOCK_NODES : MIN(tree->blocks->nodes * 2, MAX_BLOCK_NODES);
+		bst_block_t *block = malloc(sizeof(bst_block_t) + nodes * size);
+		if (block == NULL)
+			return NULL;
+
+		block->next = tree->blocks;
+		block->nodes = nodes;
+		tree->blocks = block;
+		tree->block_free = nodes;
+	}
+
+	bst_block_t *block = tree->blocks;
+	bst_node_t *ret = (bst_node_t *)(block->data + (block->nodes - tree->block_free--) * size);
 	ret->in_tree = 0;
 	ret->inserted = 0;
 	ret->saved = 0;
@@ -483,6 +667,156 @@ bst_erase_range(bst_t *tree, bst_node_t *beg, bst_node_t *end)
 		beg = bst_erase(tree, beg);
 }
 
+/* height of a subtree, found by following the taller children */
+static int
+subtree_height(bst_node_t *node)
+{
+	int ret = 0;
+
+	for (; node != NULL; node = node->child[node->balance < 0])
+		ret++;
+	return ret;
+}
+
+static bst_node_t *
+new_node(bst_t *tree, const void *data)
+{
+	bst_node_t *node = alloc_node(tree);
+
+	if (tree->tip != NULL) {
+		if (!node->inserted)
+			slist_push(&tree->inserted, node);
+		node->inserted = 1;
+	}
+
+	memcpy(node->data, data, tree->csize);
+	assert(!node->in_tree);
+	node->in_tree = 1;
+	tree->tree_size++;
+	return node;
+}
+
+/*
+ * builds a perfectly balanced subtree of n sorted elements, in order,
+ * so the nodes end up next to each other in the allocation blocks.
+ * dynamic data is computed bottom-up, once per node
+ */
+static bst_node_t *
+build_subtree(bst_t *tree, const char *data, size_t n, size_t size, int *height)
+{
+	if (n == 0) {
+		*height = 0;
+		return NULL;
+	}
+
+	int h[2];
+	size_t mid = n / 2;
+	bst_node_t *left = build_subtree(tree, data, mid, size, &h[0]);
+	bst_node_t *node = new_node(tree, data + mid * size);
+	bst_node_t *right = build_subtree(tree, data + (mid + 1) * size, n - mid - 1, size, &h[1]);
+
+	set_child(node, 0, left);
+	set_child(node, 1, right);
+	node->balance = h[0] - h[1];
+	if (tree->upd != NULL)
+		tree->upd(node);
+
+	*height = MAX(h[0], h[1]) + 1;
+	return node;
+}
+
+/*
+ * joins the tree with a subtree whose elements all go after (dir == 1)
+ * or before (dir == 0) the tree ones, using the pivot node in between.
+ * only the spine of the taller one is walked, so it's O(|height difference|)
+ */
+static void
+join(bst_t *tree, bst_node_t *pivot, bst_node_t *sub, int sub_height, int dir)
+{
+	bst_node_t *parent = &tree->head, *v = bst_root(tree);
+	int idx = 0, v_height = subtree_height(v);
+	int v_dir = dir;
+
+	if (sub_height > v_height) {
+		/* the subtree is taller, so descend into it on the other side */
+		SWAP(v, sub, bst_node_t *);
+		SWAP(v_height, sub_height, int);
+		v_dir = !dir;
+		set_root(tree, v);
+	}
+
+	while (v_height > sub_height + 1) {
+		v_height -= v->balance == (v_dir ? 1 : -1) ? 2 : 1;
+		parent = v;
+		idx = v_dir;
+		v = v->child[v_dir];
+	}
+
+	set_child(pivot, !v_dir, v);
+	set_child(pivot, v_dir, sub);
+	pivot->balance = v_dir ? v_height - sub_height : sub_height - v_height;
+	set_child(parent, idx, pivot);
+	update_to_top(tree, pivot);
+
+	/* the subtree in place of v became one level higher */
+	for (bst_node_t *i = parent; i != &tree->head; ) {
+		i->balance += idx ? -1 : 1;
+		if (i->balance == 0)
+			break;
+
+		bst_node_t *up = i->parent;
+		int up_idx = i->idx;
+		if ((i->balance < -1 || i->balance > 1) && rebalance(tree, i))
+			break;
+		i = up;
+		idx = up_idx;
+	}
+}
+
+/**
+ * Append sorted elements to the tree.
+ * All the elements must go after the ones already in the tree.
+ * The new elements get built into a balanced subtree in O(n),
+ * which is then joined with the tree in O(log(size)).
+ * @param data
+ *   Array of \c n elements, \c size bytes each.
+ * @return
+ *   The first appended node, or \c &tree->head if \c n is 0.
+ */
+bst_node_t *
+bst_append_sorted(bst_t *tree, const void *data, size_t n, size_t size)
+{
+	const char *d = data;
+	if (n == 0)
+		return bst_end(tree);
+
+#ifndef NDEBUG
+	if (!bst_empty(tree))
+		assert(tree->cmp(bst_prev(bst_end(tree))->data, d) <= 0);
+	for (size_t i = 1; i < n; i++)
+		assert(tree->cmp(d + (i - 1) * size, d + i * size) <= 0);
+#endif
+
+	int sub_height;
+	bst_node_t *pivot = new_node(tree, d);
+	bst_node_t *sub = build_subtree(tree, d + size, n - 1, size, &sub_height);
+
+	join(tree, pivot, sub, sub_height, 1);
+	return pivot;
+}
+
+/**
+ * Replace the tree contents with sorted elements.
+ * @return
+ *   Same as \c bst_append_sorted().
+ */
+bst_node_t *
+bst_build_sorted(bst_t *tree, const void *data, size_t n, size_t size)
+{
+	bst_clear(tree);
+	return bst_append_sorted(tree, data, n, size);
+}
+
 void
 bst_change(bst_t *tree, bst_node_t *node, const void *data)
 {
@@ -498,9 +832,7 @@ bst_change(bst_t *tree, bst_node_t *node, const void *data)
 		memcpy(node->data, data, tree->csize);
 	}
 
-	//TODO: optimize
-	erase_node(tree, node);
-	insert_node(tree, node);
+	resort_node(tree, node);
 }
 
 /**
@@ -554,7 +886,7 @@ bst_upper_bound(bst_t *tree, const void *data) {
         return bst_bound(tree, data, 1);
 }
 
-static void
+static bst_node_t **
 ie_pack(bst_node_t *head, int in_tree, bst_node_t **pack)
 {
 	for (; head != NULL; head = head->next) {
@@ -567,6 +899,7 @@ ie_pack(bst_node_t *head, int in_tree, bst_node_t **pack)
 		}
 		head->inserted = 0;
 	}
+	return pack;
 }
 
 /**
@@ -581,69 +914,86 @@ bst_commit(bst_t *tree)
 	if (tree->tip == NULL)
 		return tree->tip = create_rev(NULL);
 
-	bst_node_t **inserted = NULL, **erased = NULL;
+	size_t cs = tree->csize;
 	int inserted_count = slist_size(tree->inserted, 1);
 	int erased_count = slist_size(tree->erased, 0);
+	int changed_count = 0;
+	bst_node_t **ie = NULL, *i;
 
-	if (inserted_count)
-		inserted = malloc(inserted_count * sizeof(bst_node_t *));
-	if (erased_count)
-		erased = malloc(erased_count * sizeof(bst_node_t *));
-	ie_pack(tree->inserted, 1, inserted);
-	ie_pack(tree->erased, 0, erased);
+	if (inserted_count + erased_count)
+		ie = malloc((inserted_count + erased_count) * sizeof(bst_node_t *));
+	ie_pack(tree->erased, 0, ie_pack(tree->inserted, 1, ie));
 
-	bst_node_t **changed = NULL;
-	int changed_count = 0;
-	void *changed_data = NULL;
-	for (bst_node_t *i = tree->save; i != NULL; i = i->child[1]) {
+	for (i = tree->save; i != NULL; i = i->child[1]) {
 		assert(!i->in_tree);
 		if (i->parent->saved) {
 			if (i->parent->in_tree)
 				changed_count++;
 			else {
-				memcpy(i->parent->data, i->data, tree->csize);
+				memcpy(i->parent->data, i->data, cs);
 				i->parent->saved = 0;
 			}
 		}
 		if (i->child[1] == tree->save)
 			break;
 	}
-	if (changed_count) {
-		changed = malloc(changed_count * sizeof(bst_node_t *));
-		changed_data = malloc(changed_count * tree->csize);
-		int j = 0;
-		for (bst_node_t *i = tree->save; i != NULL; i = tree->save) {
-			if (i->parent->saved) {
-				assert(i->parent->in_tree);
-				changed[j] = i->parent;
-				memcpy(changed_data + j * tree->csize, i->data, tree->csize);
-				i->parent->saved = 0;
-				j++;
-			}
-			dlist_erase(&tree->save, i);
-			dlist_insert(&tree->free, i);
+
+	int count = inserted_count + erased_count + changed_count;
+	bst_rev_t *rev = NULL;
+	bst_diff_t *diff = NULL;
+	if (count) {
+		rev = create_rev(tree->tip);
+		diff = &rev->diff;
+		diff_alloc(tree, diff, count);
+	}
+
+	int j;
+	for (j = 0; j < inserted_count; j++) {
+		diff->node[j] = ie[j];
+		diff->in[j] = BST_IN_AFTER;
+		memcpy(diff->after + j * cs, ie[j]->data, cs);
+	}
+	for (; j < inserted_count + erased_count; j++) {
+		diff->node[j] = ie[j];
+		diff->in[j] = BST_IN_BEFORE;
+		memcpy(diff->before + j * cs, ie[j]->data, cs);
+		dlist_insert(&tree->free, ie[j]);
+	}
+	free(ie);
+	for (i = tree->save; i != NULL; i = tree->save) {
+		if (i->parent->saved) {
+			assert(i->parent->in_tree);
+			diff->node[j] = i->parent;
+			diff->in[j] = BST_IN_BEFORE | BST_IN_AFTER;
+			memcpy(diff->before + j * cs, i->data, cs);
+			memcpy(diff->after + j * cs, i->parent->data, cs);
+			i->parent->saved = 0;
+			j++;
 		}
-		assert(j == changed_count);
+		dlist_erase(&tree->save, i);
+		dlist_insert(&tree->free, i);
 	}
+	assert(j == count);
 
 	tree->inserted = tree->erased = tree->save = NULL;
 
-	if (inserted || erased || changed) {
-		tree->tip = create_rev(tree->tip);
-
-		tree->tip->inserted = inserted;
-		tree->tip->erased = erased;
-		tree->tip->changed = changed;
-		tree->tip->inserted_count = inserted_count;
-		tree->tip->erased_count = erased_count;
-		tree->tip->changed_count = changed_count;
-		tree->tip->changed_data = changed_data;
-
-		free_erased(tree, tree->tip);
+	if (rev != NULL) {
+		link_jump(tree, rev);
+		tree->tip = rev;
 	}
 	return tree->tip;
 }
 
+/**
+ * Check for changes since the last revision.
+ * A tree that was never committed counts as changed.
+ */
+bool_t
+bst_dirty(bst_t *tree)
+{
+	return tree->tip == NULL || tree->inserted != NULL || tree->erased != NULL || tree->save != NULL;
+}
+
 /**
  * Revert the tree to the last committed revision.
  * Has same effect as \code bst_update(tree->tip); \endcode
@@ -689,100 +1039,62 @@ bst_revert(bst_t *tree)
 	return first;
 }
 
-static int
-level(bst_rev_t *rev)
-{
-	int ret = 0;
-
-	for (; rev->parent != NULL; rev = rev->parent)
-		ret++;
-	return ret;
-}
-
-static bst_rev_t **
-path_down(bst_rev_t *from, bst_rev_t *to)
+/* the deepest revision that both a and b descend from */
+static bst_rev_t *
+common_ancestor(bst_rev_t *a, bst_rev_t *b)
 {
-	int from_level = level(from);
-	int to_level = level(to);
-
-	while (from_level > to_level) {
-		from_level--;
-		from = from->parent;
-	}
-
-	{
-		bst_rev_t *i = to;
-		int i_level = to_level;
-
-		while (i_level > from_level) {
-			i_level--;
-			i = i->parent;
-		}
-
-		while (from != i) {
-			from_level--;
-			from = from->parent;
-			i = i->parent;
+	while (a->level > b->level)
+		a = a->jump->level >= b->level ? a->jump : a->parent;
+	while (b->level > a->level)
+		b = b->jump->level >= a->level ? b->jump : b->parent;
+
+	/* revisions on the same level jump the same distance */
+	while (a != b) {
+		if (a->jump == b->jump) {
+			a = a->parent;
+			b = b->parent;
+		} else {
+			a = a->jump;
+			b = b->jump;
 		}
 	}
-
-	bst_rev_t **path = malloc((to_level - from_level + 1) * sizeof(bst_rev_t *));
-
-	for (int i = to_level - from_level; i >= 0; i--) {
-		path[i] = to;
-		to = to->parent;
-	}
-
-	return path;
+	return a;
 }
 
-static void
-memswap(void *_a, void *_b, size_t s)
+/* the longest step from rev towards its ancestor, and the diff it goes across */
+static bst_rev_t *
+step_up(bst_rev_t *rev, bst_rev_t *ancestor, bst_diff_t **diff)
 {
-	char *a = _a, *b = _b;
-	while (s--) {
-		SWAP(*a, *b, char);
-		a++;
-		b++;
+	if (rev->jump->level >= ancestor->level) {
+		*diff = jump_diff(rev);
+		return rev->jump;
 	}
+	*diff = &rev->diff;
+	return rev->parent;
 }
 
-/* applies/reverts a changeset */
+/*
+ * goes across the diff, but only on paper: node data is set in place,
+ * while the nodes are just marked with where they should end up.
+ * bst_update() then moves each of them once, however many
+ * revisions it went through
+ */
 static void
-toggle(bst_t *tree, bst_rev_t *rev, bst_node_t **affected)
+toggle(bst_t *tree, bst_diff_t *diff, int in, const char *data, bst_node_t **affected)
 {
-	unfree_erased(tree, rev);
-
-#ifndef DOXYGEN_IGNORE
-#define ADD(node, was) \
-	if (!node->inserted) { \
-		node->was_in_tree = was; \
-		node->inserted = 1; \
-		slist_push(affected, node); \
-	}
-#endif
-	int i;
-	for (i = 0; i < rev->erased_count; i++) {
-		ADD(rev->erased[i], 0);
-		insert_node(tree, rev->erased[i]);
-	}
-	for (i = 0; i < rev->inserted_count; i++) {
-		ADD(rev->inserted[i], 1);
-		erase_node(tree, rev->inserted[i]);
-	}
-#undef ADD
-	for (i = 0; i < rev->changed_count; i++) {
-		//TODO: optimize
-		erase_node(tree, rev->changed[i]);
-		memswap(rev->changed[i]->data, rev->changed_data + i * tree->csize, tree->csize);
-		insert_node(tree, rev->changed[i]);
+	for (int i = 0; i < diff->count; i++) {
+		bst_node_t *node = diff->node[i];
+
+		if (!node->inserted) {
+			node->was_in_tree = node->in_tree;
+			node->will_be_in_tree = node->in_tree;
+			node->inserted = 1;
+			slist_push(affected, node);
+		}
+		node->will_be_in_tree = (diff->in[i] & in) != 0;
+		if (node->will_be_in_tree)
+			memcpy(node->data, data + i * tree->csize, tree->csize);
 	}
-
-	SWAP(rev->erased_count, rev->inserted_count, int);
-	SWAP(rev->erased, rev->inserted, void *);
-	SWAP(rev->erased_data, rev->uninserted_data, void *);
-
-	free_erased(tree, rev);
 }
 
 /**
@@ -798,15 +1110,46 @@ bst_update(bst_t *tree, bst_rev_t *rev)
 	for (i = affected; i != NULL; i = i->next) {
 		i->inserted = 1;
 		i->was_in_tree = !i->in_tree;
+		i->will_be_in_tree = i->in_tree;
+	}
+
+	bst_rev_t *top = common_ancestor(tree->tip, rev), *j;
+	bst_diff_t *diff;
+
+	for (j = tree->tip; j != top; ) {
+		j = step_up(j, top, &diff);
+		toggle(tree, diff, BST_IN_BEFORE, diff->before, &affected);
 	}
 
-	bst_rev_t **down = path_down(tree->tip, rev);
-	for (bst_rev_t *i = tree->tip; i != down[0]; i = i->parent)
-		toggle(tree, i, &affected);
-	for (bst_rev_t **j = down + 1; j[-1] != rev; j++)
-		toggle(tree, *j, &affected);
+	/* the way down is found bottom-up, and gone top-down */
+	int steps = 0, k;
+	for (j = rev; j != top; j = step_up(j, top, &diff))
+		steps++;
+	bst_diff_t **down = malloc(steps * sizeof(bst_diff_t *));
+	for (j = rev, k = steps; j != top; )
+		j = step_up(j, top, &down[--k]);
+	for (k = 0; k < steps; k++)
+		toggle(tree, down[k], BST_IN_AFTER, down[k]->after, &affected);
 	free(down);
 
+	/*
+	 * take out everything that was touched, since the data of the nodes
+	 * left in the tree may have changed, then put back what belongs there.
+	 * nodes out of the tree live in the free list
+	 */
+	for (i = affected; i != NULL; i = i->next) {
+		if (i->in_tree) {
+			erase_node(tree, i);
+			if (!i->will_be_in_tree)
+				dlist_insert(&tree->free, i);
+		} else if (i->will_be_in_tree)
+			dlist_erase(&tree->free, i);
+	}
+	for (i = affected; i != NULL; i = i->next) {
+		if (i->will_be_in_tree)
+			insert_node(tree, i);
+	}
+
 	bst_node_t *first = NULL, *prev = NULL;
 	for (i = affected; i != NULL; i = i->next) {
 		i->inserted = 0;
@@ -824,3 +1167,129 @@ bst_update(bst_t *tree, bst_rev_t *rev)
 	tree->tip = rev;
 	return first;
 }
+
+/* rev has exactly one child that is needed to reach a kept revision */
+static bst_rev_t *
+only_needed_child(bst_rev_t *rev)
+{
+	bst_rev_t *ret = NULL;
+
+	for (bst_rev_t *i = rev->child; i != NULL; i = i->brother) {
+		if (i->needed) {
+			if (ret != NULL)
+				return NULL;
+			ret = i;
+		}
+	}
+	return ret;
+}
+
+/* drops the children that aren't needed */
+static void
+prune_children(bst_rev_t *rev)
+{
+	bst_rev_t **i = &rev->child;
+
+	while (*i != NULL) {
+		bst_rev_t *child = *i;
+		if (child->needed)
+			i = &child->brother;
+		else {
+			*i = child->brother;
+			child->brother = NULL;
+			destroy_revs(child);
+		}
+	}
+}
+
+/**
+ * Forget the history, except for what it takes to update to
+ * any of the \c keep revisions (and \c tree->tip, which is always kept).
+ * Revisions in between get squashed into one diff, the common ancestor
+ * of the kept ones becomes the root, and everything else is freed.
+ * Pointers to the revisions that were not kept are no longer valid.
+ * Erased nodes that no diff remembers stay in the free list for reuse.
+ */
+void
+bst_prune(bst_t *tree, bst_rev_t **keep, int n)
+{
+	if (tree->tip == NULL)
+		return;
+
+	bst_rev_t *top = tree->tip, *i, *j;
+	int k;
+
+	for (k = 0; k < n; k++)
+		top = common_ancestor(top, keep[k]);
+
+	top->needed = 1;
+	for (k = -1; k < n; k++) {
+		i = k < 0 ? tree->tip : keep[k];
+		i->keep = 1;
+		for (j = i; !j->needed; j = j->parent)
+			j->needed = 1;
+	}
+
+	/* everything above top goes, including the branches off the way to it */
+	if (top->parent != NULL) {
+		bst_rev_t **link = &top->parent->child;
+		while (*link != top)
+			link = &(*link)->brother;
+		*link = top->brother;
+
+		destroy_revs(root_rev(top->parent));
+		top->parent = top->brother = NULL;
+	}
+	diff_free(&top->diff);
+	diff_free(&top->jump_diff);
+	top->level = 0;
+	top->jump = NULL;
+
+	/* the children of each revision get fixed up before it's left */
+	for (i = top; i != NULL; i = next_rev(i, top)) {
+		prune_children(i);
+		for (bst_rev_t **c = &i->child; *c != NULL; c = &(*c)->brother) {
+			bst_rev_t *child = *c, *grandchild;
+
+			while (!child->keep && (grandchild = only_needed_child(child)) != NULL) {
+				bst_diff_t squashed;
+
+				prune_children(child);
+				diff_compose(tree, &squashed,
+					(bst_diff_t *[]){&child->diff, &grandchild->diff}, 2);
+				diff_free(&grandchild->diff);
+				grandchild->diff = squashed;
+				grandchild->parent = i;
+				grandchild->brother = child->brother;
+				*c = grandchild;
+				destroy_rev(child);
+				child = grandchild;
+			}
+
+			child->level = i->level + 1;
+			diff_free(&child->jump_diff);
+			link_jump(tree, child);
+		}
+	}
+
+	for (i = top; i != NULL; i = next_rev(i, top))
+		i->keep = i->needed = 0;
+}
+
+/**
+ * Memory taken by the revisions of the tree and their diffs.
+ * The nodes themselves are not counted.
+ */
+size_t
+bst_history_size(bst_t *tree)
+{
+	size_t ret = 0;
+
+	if (tree->tip == NULL)
+		return 0;
+
+	bst_rev_t *root = root_rev(tree->tip);
+	for (bst_rev_t *i = root; i != NULL; i = next_rev(i, root))
+		ret += sizeof(*i) + diff_size(tree, &i->diff) + diff_size(tree, &i->jump_diff);
+	return ret;
+}
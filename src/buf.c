@@ -0,0 +1,66 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ */
+
+#include <stdlib.h> /* realloc */
+#include <memory.h> /* memcpy */
+#include "vomid_local.h"
+
+#define MIN_SIZE 1024
+
+void
+buf_init(buf_t *buf)
+{
+	buf->data = NULL;
+	buf->size = 0;
+	buf->max_size = 0;
+	buf->failed = FALSE;
+}
+
+void
+buf_fini(buf_t *buf)
+{
+	free(buf->data);
+	buf_init(buf);
+}
+
+void *
+buf_grow(buf_t *buf, size_t size)
+{
+	if (buf->failed)
+		return NULL;
+
+	if (buf->max_size - buf->size < size) {
+		size_t max_size = MAX(buf->max_size, MIN_SIZE);
+		while (max_size - buf->size < size)
+			max_size *= 2;
+
+		uchar *data = realloc(buf->data, max_size);
+		if (data == NULL) {
+			buf->failed = TRUE;
+			return NULL;
+		}
+		buf->data = data;
+		buf->max_size = max_size;
+	}
+
+	void *ret = buf->data + buf->size;
+	buf->size += size;
+	return ret;
+}
+
+void
+buf_write(buf_t *buf, const void *data, size_t size)
+{
+	void *p = buf_grow(buf, size);
+	if (p != NULL)
+		memcpy(p, data, size);
+}
+
+void
+buf_putc(buf_t *buf, int c)
+{
+	uchar *p = buf_grow(buf, 1);
+	if (p != NULL)
+		*p = c;
+}
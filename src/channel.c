@@ -2,7 +2,13 @@
  * See LICENSE file for license details.
  */
 
+#include "config.h"
+
 #include <stdlib.h> /* malloc */
+#include <memory.h> /* memset */
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#endif
 #include "vomid_local.h"
 
 typedef struct channel_note_t {
@@ -58,7 +64,7 @@ static void
 upd(bst_node_t *node)
 {
 	channel_note_t *c_note = (channel_note_t *)node->data;
-	c_note->max_off = MAX3(off(node), off(node->child[0]), off(node->child[1]));
+	c_note->max_off = MAX3(off(node), max_off(node->child[0]), max_off(node->child[1]));
 }
 
 DEFINE_RANGE_FN
@@ -70,13 +76,49 @@ channel_range(channel_t *channel, time_t s, time_t e,
 	return range(&channel->notes, s, e, clb, arg);
 }
 
+/*
+ * what every controller of every channel reads as until it is written.
+ * they are never written themselves, so they hold no nodes and need no map_fini()
+ */
+static map_t default_ctrl[CCTRLS];
+
+static void
+init_default_ctrl(void)
+{
+	for (int i = 0; i < CCTRLS; i++)
+		map_init(&default_ctrl[i], cctrl_info[i].default_value);
+}
+
+#ifdef HAVE_PTHREADS
+static pthread_once_t default_ctrl_once = PTHREAD_ONCE_INIT;
+# define INIT_DEFAULT_CTRL() pthread_once(&default_ctrl_once, init_default_ctrl)
+#else
+/* no threads to race with */
+static bool_t default_ctrl_ready = FALSE;
+# define INIT_DEFAULT_CTRL() do { \
+	if (!default_ctrl_ready) { \
+		init_default_ctrl(); \
+		default_ctrl_ready = TRUE; \
+	} \
+} while (0)
+#endif
+
+static bool_t
+owned(channel_t *channel, int ctrl)
+{
+	return channel->ctrl[ctrl] != &default_ctrl[ctrl];
+}
+
 void
 channel_init(channel_t *channel, int number)
 {
+	INIT_DEFAULT_CTRL();
+
 	channel->number = number;
 	bst_init(&channel->notes, sizeof(channel_note_t), sizeof(note_t *), cmp, upd);
+	memset(channel->used_ctrls, 0, sizeof(channel->used_ctrls));
 	for (int i = 0; i < CCTRLS; i++)
-		map_init(&channel->ctrl[i], cctrl_info[i].default_value);
+		channel->ctrl[i] = &default_ctrl[i];
 	channel->next = NULL;
 }
 
@@ -84,8 +126,44 @@ void
 channel_fini(channel_t *channel)
 {
 	bst_fini(&channel->notes);
-	for (int i = 0; i < CCTRLS; i++)
-		map_fini(&channel->ctrl[i]);
+	for (int i = 0; i < CCTRLS; i++) {
+		if (owned(channel, i)) {
+			map_fini(channel->ctrl[i]);
+			free(channel->ctrl[i]);
+		}
+	}
+}
+
+map_t *
+channel_ctrl(channel_t *channel, int ctrl)
+{
+	if (owned(channel, ctrl))
+		return channel->ctrl[ctrl];
+
+	map_t *map = malloc(sizeof(*map));
+	map_init(map, cctrl_info[ctrl].default_value);
+	map_track_usage(map, channel->used_ctrls, ctrl);
+	/*
+	 * revisions committed before now don't mention this controller;
+	 * give it an empty root revision for channel_update to go back to
+	 */
+	if (channel->notes.tip != NULL)
+		bst_commit(&map->bst);
+	channel->ctrl[ctrl] = map;
+	return map;
+}
+
+/* a controller that was never non-empty on either side holds no changes to copy */
+void
+channel_copy_ctrls(channel_t *from, time_t beg, time_t end, channel_t *to, time_t to_beg)
+{
+	uint64_t used[BITMAP_WORDS(CCTRLS)];
+	int i;
+
+	for (i = 0; i < BITMAP_WORDS(CCTRLS); i++)
+		used[i] = from->used_ctrls[i] | to->used_ctrls[i];
+	FOREACH_BIT(i, used, CCTRLS)
+		map_copy(from->ctrl[i], beg, end, channel_ctrl(to, i), to_beg);
 }
 
 channel_t *
@@ -99,26 +177,98 @@ channel_create(int number)
 void
 channel_commit(channel_t *channel, channel_rev_t *rev)
 {
+	int i;
+
+	/* give the empty written controllers their root revision, see channel_ctrl() */
+	if (channel->notes.tip == NULL) {
+		for (i = 0; i < CCTRLS; i++)
+			if (owned(channel, i) && bst_empty(&channel->ctrl[i]->bst))
+				bst_commit(&channel->ctrl[i]->bst);
+	}
+
 	rev->notes = bst_commit(&channel->notes);
-	for (int i = 0; i < CCTRLS; i++)
-		rev->ctrl[i] = bst_commit(&channel->ctrl[i].bst);
+	/* controllers that were never non-empty have nothing to commit */
+	memset(rev->ctrl, 0, sizeof(rev->ctrl));
+	FOREACH_BIT(i, channel->used_ctrls, CCTRLS)
+		rev->ctrl[i] = bst_commit(&channel->ctrl[i]->bst);
+}
+
+/* has anything changed since the last commit or update */
+bool_t
+channel_dirty(channel_t *channel)
+{
+	int i;
+
+	if (bst_dirty(&channel->notes))
+		return TRUE;
+	FOREACH_BIT(i, channel->used_ctrls, CCTRLS) {
+		if (bst_dirty(&channel->ctrl[i]->bst))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* the revision of a used controller that goes with rev */
+static bst_rev_t *
+ctrl_rev(channel_t *channel, int ctrl, channel_rev_t *rev)
+{
+	bst_rev_t *ret = rev->ctrl[ctrl];
+
+	/* it was still empty back then */
+	if (ret == NULL) {
+		for (ret = channel->ctrl[ctrl]->bst.tip; ret->jump != NULL; ret = ret->jump)
+			;
+	}
+	return ret;
 }
 
 void
 channel_update(channel_t *channel, channel_rev_t *rev)
 {
 	bst_node_t *node = bst_update(&channel->notes, rev->notes);
+	/*
+	 * removed nodes leave note->channel alone: erased nodes get reused,
+	 * so the note may still be here through another node
+	 */
 	for (; node != NULL; node = node->next) {
 		if (node->in_tree) {
 			channel_note(node)->channel = channel;
 			channel_note(node)->track->channel_usage[channel->number]++;
 		} else {
-			channel_note(node)->channel = NULL;
 			channel_note(node)->track->channel_usage[channel->number]--;
 		}
 	}
+	int i;
+	FOREACH_BIT(i, channel->used_ctrls, CCTRLS)
+		bst_update(&channel->ctrl[i]->bst, ctrl_rev(channel, i, rev));
+}
+
+void
+channel_prune(channel_t *channel, channel_rev_t **keep, int n)
+{
+	bst_rev_t **revs = malloc(n * sizeof(*revs));
+	int i, k;
+
+	for (k = 0; k < n; k++)
+		revs[k] = keep[k]->notes;
+	bst_prune(&channel->notes, revs, n);
+	FOREACH_BIT(i, channel->used_ctrls, CCTRLS) {
+		for (k = 0; k < n; k++)
+			revs[k] = ctrl_rev(channel, i, keep[k]);
+		bst_prune(&channel->ctrl[i]->bst, revs, n);
+	}
+	free(revs);
+}
+
+size_t
+channel_history_size(channel_t *channel)
+{
+	size_t ret = bst_history_size(&channel->notes);
+
 	for (int i = 0; i < CCTRLS; i++)
-		bst_update(&channel->ctrl[i].bst, rev->ctrl[i]);
+		if (owned(channel, i))
+			ret += bst_history_size(&channel->ctrl[i]->bst);
+	return ret;
 }
 
 note_t *
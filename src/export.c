@@ -3,66 +3,97 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h> /* malloc */
 #include <string.h>
 #include <assert.h>
 #include "vomid_local.h"
 #include "3rdparty/sha1/sha1.h"
 
-#define BUF_SIZE 1024
-
 #define NULL_TRACK 1
 #define LAST_TRACK 1
 
 #define ZERO_DTIME 1
-#define SHA (META_HEADER_SIZE + PROPR_HEADER_SIZE + SHA1_SIZE)
+#define CHECKSUM(size) (META_HEADER_SIZE + PROPR_HEADER_SIZE + (size))
+
+/* how much of a track is hashed at once while it's being written */
+#define HASH_STEP 4096
 
 #define MIDI_FORMAT 1
+#define MTHD_SIZE (CHUNK_HEADER_SIZE + 2 + 2 + 2)
+
+/* header, track chunk headers and contents, eots, checksum */
+#define MAX_PARTS (1 + 3 * (MAX_TRACKS + NULL_TRACK) + 1)
+
+typedef struct part_t {
+	const void *data;
+	size_t size;
+} part_t;
 
 typedef struct track_export_ctx_t {
-	FILE *fbuf;
+	buf_t buf;
 	time_t dtime;
+	uchar header[CHUNK_HEADER_SIZE];
+
+	hash64_t hash;
+	size_t hashed;
 } track_export_ctx_t;
 
+/*
+ * tracks are written to their own buffers, then the output is described as
+ * a list of parts pointing into them, so it can be written out or copied
+ * in one go without moving the track data around.
+ *
+ * the SHA1 checksum covers the bytes of the header and the tracks in file
+ * order, so it is computed over the parts once they are all there. HASH64
+ * instead combines the header with a digest of every chunk, and the chunks
+ * are hashed while they are being written.
+ */
 typedef struct export_ctx_t {
 	file_t *file;
 	track_export_ctx_t track[MAX_TRACKS + NULL_TRACK];
+
+	uchar header[MTHD_SIZE];
+	uchar eot[ZERO_DTIME + sizeof(midi_eot)];
+	buf_t checksum;
+
+	part_t part[MAX_PARTS];
+	int parts;
+	size_t size;
 } export_ctx_t;
 
 static void
-write(FILE *out, const uchar *buf, size_t size, SHA_CTX *sha_ctx)
+put_int(uchar *buf, int len, int value)
 {
-	fwrite(buf, 1, size, out);
-	if (sha_ctx != NULL)
-		SHA1_Update(sha_ctx, buf, size);
+	for (int i = 0; i < len; i++) {
+		buf[len - 1 - i] = value % 0x100;
+		value /= 0x100;
+	}
 }
 
 static void
-write_int(FILE *out, int len, int value, SHA_CTX *sha_ctx)
+add_part(export_ctx_t *ctx, const void *data, size_t size)
 {
-	uchar buf[len];
+	part_t *part = &ctx->part[ctx->parts++];
+	part->data = data;
+	part->size = size;
+	ctx->size += size;
+}
 
-	for (int i = 0; i < len; i++) {
-		buf[len - 1 - i] = value % 0x100;
-		value /= 0x100;
+static void
+hash_track(track_export_ctx_t *tctx)
+{
+	if (tctx->buf.size > tctx->hashed) {
+		hash64_update(&tctx->hash, tctx->buf.data + tctx->hashed, tctx->buf.size - tctx->hashed);
+		tctx->hashed = tctx->buf.size;
 	}
-	write(out, buf, len, sha_ctx);
 }
 
 static void
-cat(FILE *src, FILE *dst, SHA_CTX *sha_ctx)
+written(export_ctx_t *ctx, track_export_ctx_t *tctx)
 {
-	long size = ftell(src);
-	char buf[BUF_SIZE];
-
-	rewind(src);
-	while (size > 0) {
-		int count = size > BUF_SIZE ? BUF_SIZE : size;
-		fread(buf, 1, count, src);
-		fwrite(buf, 1, count, dst);
-		if (sha_ctx != NULL)
-			SHA1_Update(sha_ctx, buf, count);
-		size -= count;
-	}
+	tctx->dtime = 0;
+	if (ctx->file->checksum == CHECKSUM_HASH64 && tctx->buf.size - tctx->hashed >= HASH_STEP)
+		hash_track(tctx);
 }
 
 static void
@@ -71,9 +102,9 @@ tevent_clb(int track, small_event_t *ev, void *arg)
 	export_ctx_t *ctx = arg;
 	track_export_ctx_t *tctx = &ctx->track[track + NULL_TRACK];
 
-	midi_fwrite_varlen(tctx->fbuf, tctx->dtime);
-	fwrite(ev->buf, 1, ev->len, tctx->fbuf);
-	tctx->dtime = 0;
+	midi_bwrite_varlen(&tctx->buf, tctx->dtime);
+	buf_write(&tctx->buf, ev->buf, ev->len);
+	written(ctx, tctx);
 }
 
 static status_t
@@ -92,9 +123,9 @@ note_clb(const note_t *note, void *arg)
 	export_ctx_t *ctx = arg;
 	track_export_ctx_t *tctx = &ctx->track[track_idx(note->track) + NULL_TRACK];
 	if (!notesystem_is_midistd(&note->track->notesystem)) {
-		midi_fwrite_varlen(tctx->fbuf, tctx->dtime);
-		midi_fwrite_pitch(tctx->fbuf, note->pitch);
-		tctx->dtime = 0;
+		midi_bwrite_varlen(&tctx->buf, tctx->dtime);
+		midi_bwrite_pitch(&tctx->buf, note->pitch);
+		written(ctx, tctx);
 	}
 }
 
@@ -102,10 +133,10 @@ static void
 write_tracknames(export_ctx_t *ctx)
 {
 	for (int i = 0; i < ctx->file->tracks; i++) {
-		FILE *f = ctx->track[i + NULL_TRACK].fbuf;
+		buf_t *buf = &ctx->track[i + NULL_TRACK].buf;
 		const char *tn = ctx->file->track[i]->name;
-		midi_fwrite_varlen(f, 0);
-		midi_fwrite_meta(f, META_TRACKNAME, (const uchar *)tn, strlen(tn));
+		midi_bwrite_varlen(buf, 0);
+		midi_bwrite_meta(buf, META_TRACKNAME, (const uchar *)tn, strlen(tn));
 	}
 }
 
@@ -115,62 +146,159 @@ write_notesystems(export_ctx_t *ctx)
 	for (int i = 0; i < ctx->file->tracks; i++) {
 		const notesystem_t *ns = &ctx->file->track[i]->notesystem;
 		if (!notesystem_is_midistd(ns)) {
-			FILE *f = ctx->track[i + NULL_TRACK].fbuf;
-			midi_fwrite_varlen(f, 0);
-			midi_fwrite_notesystem(f, ns);
+			buf_t *buf = &ctx->track[i + NULL_TRACK].buf;
+			midi_bwrite_varlen(buf, 0);
+			midi_bwrite_notesystem(buf, ns);
 		}
 	}
 }
 
 static void
-write_eot(FILE *out, SHA_CTX *sha_ctx)
+write_sha(export_ctx_t *ctx)
 {
-	write_int(out, ZERO_DTIME, 0, sha_ctx);
-	write(out, midi_eot, sizeof(midi_eot), sha_ctx);
+	/* everything so far, except for the sha and the last eot */
+	SHA_CTX sha_ctx;
+	SHA1_Init(&sha_ctx);
+	for (int i = 0; i < ctx->parts; i++)
+		SHA1_Update(&sha_ctx, ctx->part[i].data, ctx->part[i].size);
+
+	uchar sha[SHA1_SIZE];
+	SHA1_Final(sha, &sha_ctx);
+	midi_bwrite_varlen(&ctx->checksum, 0);
+	midi_bwrite_propr(&ctx->checksum, PROPR_SHA, sha, sizeof(sha));
 }
 
-status_t
-file_export_f(file_t *file, FILE *out)
+static void
+write_hash64(export_ctx_t *ctx)
+{
+	hash64_t hash, chunk_hash;
+	uchar digest[HASH64_SIZE];
+
+	/* the header of every chunk, followed by the digest of its contents */
+	hash64_init(&hash);
+	hash64_update(&hash, ctx->header, CHUNK_HEADER_SIZE);
+	hash64_init(&chunk_hash);
+	hash64_update(&chunk_hash, ctx->header + CHUNK_HEADER_SIZE, sizeof(ctx->header) - CHUNK_HEADER_SIZE);
+	hash64_final(&chunk_hash, digest);
+	hash64_update(&hash, digest, sizeof(digest));
+
+	for (int i = 0; i < ctx->file->tracks + NULL_TRACK; i++) {
+		track_export_ctx_t *tctx = &ctx->track[i];
+
+		hash_track(tctx);
+		if (i != ctx->file->tracks)
+			hash64_update(&tctx->hash, ctx->eot, sizeof(ctx->eot));
+		hash64_final(&tctx->hash, digest);
+
+		hash64_update(&hash, tctx->header, sizeof(tctx->header));
+		hash64_update(&hash, digest, sizeof(digest));
+	}
+
+	hash64_final(&hash, digest);
+	midi_bwrite_varlen(&ctx->checksum, 0);
+	midi_bwrite_propr(&ctx->checksum, PROPR_HASH64, digest, sizeof(digest));
+}
+
+static void
+export_fini(export_ctx_t *ctx)
+{
+	for (int i = 0; i < ctx->file->tracks + NULL_TRACK; i++)
+		buf_fini(&ctx->track[i].buf);
+	buf_fini(&ctx->checksum);
+}
+
+static status_t
+export(file_t *file, export_ctx_t *ctx)
 {
-	export_ctx_t ctx;
 	int i;
 
-	ctx.file = file;
+	ctx->file = file;
 	for (i = 0; i < file->tracks + NULL_TRACK; i++) {
-		ctx.track[i].fbuf = tmpfile();
-		ctx.track[i].dtime = 0;
+		buf_init(&ctx->track[i].buf);
+		ctx->track[i].dtime = 0;
+		hash64_init(&ctx->track[i].hash);
+		ctx->track[i].hashed = 0;
 	}
+	buf_init(&ctx->checksum);
 
-	write_tracknames(&ctx);
-	write_notesystems(&ctx);
-	file_play_(file, 0, tevent_clb, dtime_clb, note_clb, &ctx, NULL);
+	write_tracknames(ctx);
+	write_notesystems(ctx);
+	file_play_(file, 0, tevent_clb, dtime_clb, note_clb, ctx, NULL);
 
-	SHA_CTX sha_ctx;
-	SHA1_Init(&sha_ctx);
+	memcpy(ctx->header, magic_mthd, sizeof(magic_mthd));
+	put_int(ctx->header + 4, 4, 2 + 2 + 2);
+	put_int(ctx->header + 8, 2, MIDI_FORMAT);
+	put_int(ctx->header + 10, 2, file->tracks + NULL_TRACK);
+	put_int(ctx->header + 12, 2, file->division);
+
+	put_int(ctx->eot, ZERO_DTIME, 0);
+	memcpy(ctx->eot + ZERO_DTIME, midi_eot, sizeof(midi_eot));
 
-	write(out, magic_mthd, sizeof(magic_mthd), &sha_ctx);
-	write_int(out, 4, 2 + 2 + 2, &sha_ctx);
-	write_int(out, 2, MIDI_FORMAT, &sha_ctx);
-	write_int(out, 2, file->tracks + NULL_TRACK, &sha_ctx);
-	write_int(out, 2, file->division, &sha_ctx);
+	ctx->parts = 0;
+	ctx->size = 0;
+	add_part(ctx, ctx->header, sizeof(ctx->header));
 	for (i = 0; i < file->tracks + NULL_TRACK; i++) {
-		bool_t write_sha = i == file->tracks;
-		size_t add_to_back = ZERO_DTIME + sizeof(midi_eot);
-		if (write_sha)
-			add_to_back += ZERO_DTIME + SHA;
-
-		write(out, magic_mtrk, sizeof(magic_mtrk), &sha_ctx);
-		write_int(out, 4, ftell(ctx.track[i].fbuf) + add_to_back, &sha_ctx);
-		cat(ctx.track[i].fbuf, out, &sha_ctx);
-		fclose(ctx.track[i].fbuf);
-
-		if (write_sha) {
-			uchar sha[SHA1_SIZE];
-			SHA1_Final(sha, &sha_ctx);
-			midi_fwrite_varlen(out, 0);
-			midi_fwrite_propr(out, PROPR_SHA, sha, sizeof(sha));
+		track_export_ctx_t *tctx = &ctx->track[i];
+		bool_t last = i == file->tracks;
+		size_t add_to_back = sizeof(ctx->eot);
+		if (last)
+			add_to_back += ZERO_DTIME + CHECKSUM(file->checksum == CHECKSUM_HASH64 ? HASH64_SIZE : SHA1_SIZE);
+
+		memcpy(tctx->header, magic_mtrk, sizeof(magic_mtrk));
+		put_int(tctx->header + 4, 4, tctx->buf.size + add_to_back);
+		add_part(ctx, tctx->header, sizeof(tctx->header));
+		add_part(ctx, tctx->buf.data, tctx->buf.size);
+
+		if (last) {
+			if (file->checksum == CHECKSUM_HASH64)
+				write_hash64(ctx);
+			else
+				write_sha(ctx);
+			add_part(ctx, ctx->checksum.data, ctx->checksum.size);
 		}
-		write_eot(out, &sha_ctx);
+		add_part(ctx, ctx->eot, sizeof(ctx->eot));
 	}
-	return OK;
+
+	for (i = 0; i < file->tracks + NULL_TRACK; i++)
+		if (ctx->track[i].buf.failed)
+			return ERROR;
+	return ctx->checksum.failed ? ERROR : OK;
+}
+
+status_t
+file_export_f(file_t *file, FILE *out)
+{
+	export_ctx_t ctx;
+
+	status_t ret = export(file, &ctx);
+	for (int i = 0; i < ctx.parts && ret == OK; i++)
+		if (fwrite(ctx.part[i].data, 1, ctx.part[i].size, out) != ctx.part[i].size)
+			ret = ERROR;
+
+	export_fini(&ctx);
+	return ret;
+}
+
+status_t
+file_export_mem(file_t *file, void **_data, size_t *_size)
+{
+	export_ctx_t ctx;
+	uchar *data = NULL;
+
+	status_t ret = export(file, &ctx);
+	if (ret == OK)
+		data = malloc(MAX(ctx.size, 1));
+	if (data != NULL) {
+		uchar *p = data;
+		for (int i = 0; i < ctx.parts; i++) {
+			memcpy(p, ctx.part[i].data, ctx.part[i].size);
+			p += ctx.part[i].size;
+		}
+		*_data = data;
+		*_size = ctx.size;
+	} else
+		ret = ERROR;
+
+	export_fini(&ctx);
+	return ret;
 }
@@ -2,6 +2,7 @@
  * See LICENSE file for license details.
  */
 
+#include <stdlib.h> /* malloc */
 #include <memory.h> /* memcpy */
 #include "vomid_local.h"
 
@@ -13,13 +14,33 @@ file_init(file_t *file)
 	file->tracks = 0;
 	file->division = 240;
 	file->force_compatible = TRUE;
+	file->checksum = CHECKSUM_SHA1;
 	for (i = 0; i < CHANNELS; i++)
 		channel_init(&file->channel[i], i);
-	for (i = 0; i < FCTRLS; i++)
+	memset(file->used_ctrls, 0, sizeof(file->used_ctrls));
+	for (i = 0; i < FCTRLS; i++) {
 		map_init(&file->ctrl[i], fctrl_info[i].default_value);
+		map_track_usage(&file->ctrl[i], file->used_ctrls, i);
+	}
 	map_init(&file->measure_index, 1);
 	pool_init(&file->pool);
 	file->tracks_list = NULL;
+	file->rev = NULL;
+	file->revs = NULL;
+}
+
+static void
+destroy_rev(file_rev_t *rev)
+{
+	for (int i = 0; i < rev->tracks; i++)
+		if (--rev->track[i].rev->refs == 0)
+			free(rev->track[i].rev);
+	for (int i = 0; i < CHANNELS; i++)
+		if (--rev->channel[i]->refs == 0)
+			free(rev->channel[i]);
+	if (--rev->ctrl->refs == 0)
+		free(rev->ctrl);
+	free(rev);
 }
 
 void
@@ -31,6 +52,10 @@ file_fini(file_t *file)
 	for (i = 0; i < FCTRLS; i++)
 		map_fini(&file->ctrl[i]);
 	map_fini(&file->measure_index);
+	for (file_rev_t *r = file->revs, *next; r != NULL; r = next) {
+		next = r->next;
+		destroy_rev(r);
+	}
 	for (track_t *t = file->tracks_list, *next; t != NULL; t = next) {
 		next = t->next;
 		track_destroy(t);
@@ -55,11 +80,12 @@ measures(file_t *file, time_t time, int timesig)
 	return (time + measure_size - 1) / measure_size;
 }
 
-static void
-regen_measure_index(file_t *file)
+void
+file_regen_measure_index(file_t *file)
 {
-	bst_clear(&file->measure_index.bst);
 	map_t *ts_map = &file->ctrl[FCTRL_TIMESIG];
+	map_bstdata_t *index = malloc((bst_size(&ts_map->bst) + 1) * sizeof(map_bstdata_t));
+	size_t n = 0;
 	int ts = ts_map->default_value;
 	time_t time = 0;
 	int measure = 1;
@@ -68,61 +94,235 @@ regen_measure_index(file_t *file)
 		ts = map_value(i);
 		time = map_time(i);
 		measure += dm;
-		map_set(&file->measure_index, time, measure);
+		if (measure != (n == 0 ? file->measure_index.default_value : index[n - 1].value))
+			index[n++] = (map_bstdata_t){.time = time, .value = measure};
 	}
+	bst_build_sorted(&file->measure_index.bst, index, n, sizeof(map_bstdata_t));
+	free(index);
 }
 
+/* shared by all files, they may be committed on different threads */
+static unsigned long serials;
+
+static unsigned long
+next_serial(void)
+{
+	return __atomic_add_fetch(&serials, 1, __ATOMIC_RELAXED);
+}
+
+static bool_t
+ctrls_dirty(file_t *file)
+{
+	int i;
+	FOREACH_BIT(i, file->used_ctrls, FCTRLS) {
+		if (bst_dirty(&file->ctrl[i].bst))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* whether the track in slot i is the same one, in the same state, as in prev */
+static bool_t
+same_track(file_t *file, file_rev_t *prev, int i)
+{
+	return prev != NULL && i < prev->tracks && prev->track[i].track == file->track[i] &&
+		!track_dirty(file->track[i], prev->track[i].rev);
+}
+
+/*
+ * only what changed since file->rev gets committed,
+ * the rest of the revision is shared with it
+ */
 file_rev_t *
 file_commit(file_t *file)
 {
 	if (file_flatten(file) != OK)
 		return NULL;
 
-	file_rev_t *rev = pool_alloc(&file->pool, sizeof(file_rev_t));
+	file_rev_t *prev = file->rev;
+	file_rev_t *rev = malloc(sizeof(file_rev_t) + file->tracks * sizeof(rev->track[0]));
 	int i;
 
 	rev->tracks = file->tracks;
 	for (i = 0; i < file->tracks; i++) {
-		rev->track[i] = file->track[i];
-		track_commit(file->track[i], &rev->track_rev[i]);
+		rev->track[i].track = file->track[i];
+		if (same_track(file, prev, i))
+			rev->track[i].rev = prev->track[i].rev;
+		else {
+			rev->track[i].rev = malloc(sizeof(track_rev_t));
+			rev->track[i].rev->refs = 0;
+			track_commit(file->track[i], rev->track[i].rev);
+		}
+		rev->track[i].rev->refs++;
 	}
-	for (i = 0; i < CHANNELS; i++)
-		channel_commit(&file->channel[i], &rev->channel[i]);
-	for (i = 0; i < FCTRLS; i++)
-		rev->ctrl[i] = bst_commit(&file->ctrl[i].bst);
-	regen_measure_index(file);
-	return rev;
+	for (i = 0; i < CHANNELS; i++) {
+		if (prev != NULL && !channel_dirty(&file->channel[i]))
+			rev->channel[i] = prev->channel[i];
+		else {
+			rev->channel[i] = malloc(sizeof(channel_rev_t));
+			rev->channel[i]->refs = 0;
+			rev->channel[i]->serial = next_serial();
+			channel_commit(&file->channel[i], rev->channel[i]);
+		}
+		rev->channel[i]->refs++;
+	}
+	if (prev != NULL && !ctrls_dirty(file))
+		rev->ctrl = prev->ctrl;
+	else {
+		rev->ctrl = malloc(sizeof(fctrl_rev_t));
+		rev->ctrl->refs = 0;
+		rev->ctrl->serial = next_serial();
+		for (i = 0; i < FCTRLS; i++)
+			rev->ctrl->ctrl[i] = bst_commit(&file->ctrl[i].bst);
+		file_regen_measure_index(file);
+	}
+	rev->ctrl->refs++;
+
+	rev->keep = FALSE;
+	rev->next = file->revs;
+	file->revs = rev;
+	return file->rev = rev;
+}
+
+/*
+ * the serial of the revision a channel, or with channel -1 the file's own
+ * controllers, are in as they are now; 0 if they have changed since the
+ * file was last committed or updated. equal serials mean the same contents
+ */
+unsigned long
+file_serial(file_t *file, int channel)
+{
+	if (file->rev == NULL)
+		return 0;
+	if (channel < 0)
+		return ctrls_dirty(file) ? 0 : file->rev->ctrl->serial;
+	return channel_dirty(&file->channel[channel]) ? 0 : file->rev->channel[channel]->serial;
 }
 
 //TODO: dead tracks?
 void
 file_update(file_t *file, file_rev_t *rev)
 {
+	file_rev_t *prev = file->rev;
 	int i;
 
 	file->tracks = rev->tracks;
 	for (i = 0; i < file->tracks; i++) {
-		file->track[i] = rev->track[i];
-		track_update(file->track[i], &rev->track_rev[i]);
+		file->track[i] = rev->track[i].track;
+		if (!same_track(file, prev, i) || prev->track[i].rev != rev->track[i].rev)
+			track_update(file->track[i], rev->track[i].rev);
 	}
+	for (i = 0; i < CHANNELS; i++) {
+		if (prev == NULL || prev->channel[i] != rev->channel[i] || channel_dirty(&file->channel[i]))
+			channel_update(&file->channel[i], rev->channel[i]);
+	}
+	if (prev == NULL || prev->ctrl != rev->ctrl || ctrls_dirty(file)) {
+		for (i = 0; i < FCTRLS; i++)
+			bst_update(&file->ctrl[i].bst, rev->ctrl->ctrl[i]);
+		file_regen_measure_index(file);
+	}
+	file->rev = rev;
+}
+
+/*
+ * forgets the revisions other than the last few committed ones,
+ * the pinned ones and file->rev, and frees their memory.
+ * pointers to the forgotten revisions are no longer valid
+ */
+void
+file_prune(file_t *file, int last, file_rev_t **pinned, int n)
+{
+	file_rev_t *i, **j;
+	int k = 0, kept = 0;
+
+	if (file->rev == NULL)
+		return;
+
+	for (i = file->revs; i != NULL; i = i->next)
+		i->keep = k++ < last;
+	for (k = 0; k < n; k++)
+		pinned[k]->keep = TRUE;
+	file->rev->keep = TRUE;
+
+	for (i = file->revs; i != NULL; i = i->next)
+		kept += i->keep;
+	/* every kept revision has at most one of each part */
+	void **parts = malloc(kept * sizeof(void *));
+
+	for (track_t *t = file->tracks_list; t != NULL; t = t->next) {
+		k = 0;
+		for (i = file->revs; i != NULL; i = i->next) {
+			if (!i->keep)
+				continue;
+			for (int l = 0; l < i->tracks; l++) {
+				if (i->track[l].track == t) {
+					parts[k++] = i->track[l].rev;
+					break;
+				}
+			}
+		}
+		track_prune(t, (track_rev_t **)parts, k);
+	}
+	for (int c = 0; c < CHANNELS; c++) {
+		k = 0;
+		for (i = file->revs; i != NULL; i = i->next)
+			if (i->keep)
+				parts[k++] = i->channel[c];
+		channel_prune(&file->channel[c], (channel_rev_t **)parts, k);
+	}
+	bst_rev_t **ctrl_revs = malloc(kept * sizeof(bst_rev_t *));
+	for (int c = 0; c < FCTRLS; c++) {
+		k = 0;
+		for (i = file->revs; i != NULL; i = i->next)
+			if (i->keep)
+				ctrl_revs[k++] = i->ctrl->ctrl[c];
+		bst_prune(&file->ctrl[c].bst, ctrl_revs, k);
+	}
+	free(ctrl_revs);
+	free(parts);
+
+	for (j = &file->revs; *j != NULL; ) {
+		i = *j;
+		if (i->keep)
+			j = &i->next;
+		else {
+			*j = i->next;
+			destroy_rev(i);
+		}
+	}
+}
+
+/*
+ * memory taken by the revisions of the file and of all its trees.
+ * parts shared between revisions are split evenly among them
+ */
+size_t
+file_history_size(file_t *file)
+{
+	size_t ret = 0;
+	int i;
+
+	for (file_rev_t *r = file->revs; r != NULL; r = r->next) {
+		ret += sizeof(*r) + r->tracks * sizeof(r->track[0]);
+		for (i = 0; i < r->tracks; i++)
+			ret += sizeof(track_rev_t) / r->track[i].rev->refs;
+		for (i = 0; i < CHANNELS; i++)
+			ret += sizeof(channel_rev_t) / r->channel[i]->refs;
+		ret += sizeof(fctrl_rev_t) / r->ctrl->refs;
+	}
+	for (track_t *t = file->tracks_list; t != NULL; t = t->next)
+		ret += bst_history_size(&t->notes);
 	for (i = 0; i < CHANNELS; i++)
-		channel_update(&file->channel[i], &rev->channel[i]);
+		ret += channel_history_size(&file->channel[i]);
 	for (i = 0; i < FCTRLS; i++)
-		bst_update(&file->ctrl[i].bst, rev->ctrl[i]);
-	regen_measure_index(file);
+		ret += bst_history_size(&file->ctrl[i].bst);
+	return ret;
 }
 
 status_t
 file_import(file_t *file, const char *fn, bool_t *sha_ok)
 {
-	FILE *f = fopen(fn, "rb");
-	if (f == NULL)
-		return ERROR;
-
-	status_t ret = file_import_f(file, f, sha_ok);
-	fclose(f);
-	regen_measure_index(file);
-	return ret;
+	return file_import_mmap(file, fn, sha_ok);
 }
 
 status_t
@@ -10,10 +10,46 @@
 static platform_t *platforms;
 static platform_t *cur_platform[DEVICE_TYPES] = {};
 
+#define CALIBRATION_SLEEPS 16
+#define CALIBRATION_SLEEP 0.0002
+#define MAX_SLACK 0.002
+
+static systime_t slack = -1; /* not calibrated yet */
+
+/* twice the worst oversleep of a few short sleeps */
+static void
+calibrate()
+{
+	systime_t worst = 0;
+	for (int i = 0; i < CALIBRATION_SLEEPS; i++) {
+		systime_t t = systime() + CALIBRATION_SLEEP;
+		sleep_abs(t);
+		worst = MAX(worst, systime() - t);
+	}
+	slack = MIN(worst * 2, MAX_SLACK);
+}
+
+void
+set_sleep_slack(systime_t s)
+{
+	slack = s;
+}
+
+systime_t
+sleep_slack()
+{
+	if (slack < 0)
+		calibrate();
+	return slack;
+}
+
+/* sleeps till the slack before t, and spins the rest */
 void
 sleep_till(systime_t t)
 {
-	sleep(t - systime());
+	systime_t s = sleep_slack();
+	if (systime() < t - s)
+		sleep_abs(t - s);
 	while (systime() < t)
 		;
 }
@@ -28,7 +64,7 @@ fini_platforms()
 
 	platform_t *p;
 	FOR_EACH_PLATFORM(p) {
-		if (!p->initialized && p->fini != NULL)
+		if (p->initialized && p->fini != NULL)
 				p->fini();
 	}
 }
@@ -39,6 +75,8 @@ init_platforms()
 	static int initialized = 0;
 	if (!initialized) {
 		atexit(fini_platforms);
+		ADD_PLATFORM(&platform_null);
+		ADD_PLATFORM(&platform_capture);
 #ifdef HAL_ALSA
 		ADD_PLATFORM(&platform_alsa);
 #endif
@@ -101,6 +139,59 @@ output(const unsigned char *ev, size_t size)
 		cur_platform[OUTPUT_DEVICE]->output(ev, size);
 }
 
+#define BATCH 64
+
+void
+output_batch(const unsigned char *const *evs, const size_t *sizes, size_t n)
+{
+	platform_t *p = cur_platform[OUTPUT_DEVICE];
+	if (p == NULL || p->output_batch == NULL) {
+		for (size_t i = 0; i < n; i++)
+			output(evs[i], sizes[i]);
+		return;
+	}
+
+	const uchar *b_evs[BATCH];
+	size_t b_sizes[BATCH], k = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (evs[i][0] < 0x80 || evs[i][0] >= 0xF0)
+			continue;
+		b_evs[k] = evs[i];
+		b_sizes[k] = sizes[i];
+		if (++k == BATCH) {
+			p->output_batch(b_evs, b_sizes, k);
+			k = 0;
+		}
+	}
+	if (k > 0)
+		p->output_batch(b_evs, b_sizes, k);
+}
+
+bool_t
+can_output_at()
+{
+	platform_t *p = cur_platform[OUTPUT_DEVICE];
+	return p != NULL && p->output_at != NULL;
+}
+
+status_t
+output_at(const unsigned char *ev, size_t size, systime_t t)
+{
+	if (!can_output_at())
+		return ERROR;
+	if (ev[0] >= 0x80 && ev[0] < 0xF0)
+		cur_platform[OUTPUT_DEVICE]->output_at(ev, size, t);
+	return OK;
+}
+
+void
+drop_output()
+{
+	platform_t *p = cur_platform[OUTPUT_DEVICE];
+	if (p != NULL && p->drop_output != NULL)
+		p->drop_output();
+}
+
 void
 flush_output()
 {
@@ -14,6 +14,16 @@ snd_seq_t *seq;
 int port;
 snd_midi_event_t *event;
 int conn_client = -1, conn_port;
+int queue;
+
+/*
+ * the queue runs on the system clock, which NTP slews, and systime() doesn't:
+ * the queue's real time is read back at least every RESYNC seconds, and
+ * times in between are taken relative to the last reading
+ */
+#define RESYNC 1.0
+systime_t queue_synced; /* systime() when the queue's time was read */
+systime_t queue_time;
 
 #define INPUT_CAP  (SND_SEQ_PORT_CAP_READ  | SND_SEQ_PORT_CAP_SUBS_READ)
 #define OUTPUT_CAP (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE)
@@ -33,6 +43,15 @@ _init()
 			return ERROR;
 		if (snd_midi_event_new(1024, &event) < 0)
 			return ERROR;
+
+		/* events from output_at() are timestamped in this queue's real time */
+		queue = snd_seq_alloc_queue(seq);
+		if (queue < 0)
+			return ERROR;
+		snd_seq_start_queue(seq, queue, NULL);
+		snd_seq_drain_output(seq);
+		queue_synced = systime();
+		queue_time = 0;
 		return OK;
 	} else
 		return ERROR;
@@ -41,6 +60,7 @@ _init()
 static void
 _fini()
 {
+	snd_seq_free_queue(seq, queue);
 	snd_seq_close(seq);
 	snd_midi_event_free(event);
 }
@@ -98,22 +118,90 @@ _set_device(int type, const char *id)
 	return ERROR;
 }
 
+static bool_t
+encode(snd_seq_event_t *ev, const uchar *ev_raw, size_t size)
+{
+	snd_seq_ev_clear(ev);
+	if (snd_midi_event_encode(event, ev_raw, size, ev) <= 0 ||
+		ev->type == SND_SEQ_EVENT_NONE)
+			return FALSE;
+
+	snd_seq_ev_set_source(ev, port);
+	snd_seq_ev_set_subs(ev);
+	return TRUE;
+}
+
 static void
 _output(const uchar *ev_raw, size_t size)
 {
 	snd_seq_event_t ev;
-	snd_seq_ev_clear(&ev);
-	if (snd_midi_event_encode(event, ev_raw, size, &ev) <= 0 ||
-		ev.type == SND_SEQ_EVENT_NONE)
-			return;
+	if (!encode(&ev, ev_raw, size))
+		return;
 
-	snd_seq_ev_set_source(&ev, port);
-	snd_seq_ev_set_subs(&ev);
 	snd_seq_ev_set_direct(&ev);
+	snd_seq_event_output(seq, &ev);
+}
+
+/* snd_seq_event_output() copies into the output buffer, drained once for all */
+static void
+_output_batch(const uchar *const *evs, const size_t *sizes, size_t n)
+{
+	snd_seq_event_t ev;
+
+	for (size_t i = 0; i < n; i++) {
+		if (!encode(&ev, evs[i], sizes[i]))
+			continue;
+		snd_seq_ev_set_direct(&ev);
+		snd_seq_event_output(seq, &ev);
+	}
+	snd_seq_drain_output(seq);
+}
+
+/* the queue's real time at systime() t */
+static systime_t
+queue_time_at(systime_t t)
+{
+	systime_t now = systime();
+	if (now - queue_synced >= RESYNC) {
+		snd_seq_queue_status_t *status;
+
+		snd_seq_queue_status_alloca(&status);
+		if (snd_seq_get_queue_status(seq, queue, status) >= 0) {
+			const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(status);
+			queue_time = rt->tv_sec + (systime_t)rt->tv_nsec / (1000 * 1000 * 1000);
+			queue_synced = now;
+		}
+	}
+	return queue_time + (t - queue_synced);
+}
 
+static void
+_output_at(const uchar *ev_raw, size_t size, systime_t t)
+{
+	snd_seq_event_t ev;
+	if (!encode(&ev, ev_raw, size))
+		return;
+
+	snd_seq_real_time_t rt;
+	t = MAX(queue_time_at(t), 0);
+	rt.tv_sec = (unsigned int)t;
+	rt.tv_nsec = (unsigned int)((t - rt.tv_sec) * 1000 * 1000 * 1000);
+	snd_seq_ev_schedule_real(&ev, queue, 0, &rt);
 	snd_seq_event_output(seq, &ev);
 }
 
+static void
+_drop_output()
+{
+	snd_seq_remove_events_t *rm;
+
+	snd_seq_drop_output(seq);
+	snd_seq_remove_events_alloca(&rm);
+	snd_seq_remove_events_set_queue(rm, queue);
+	snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT);
+	snd_seq_remove_events(seq, rm);
+}
+
 static void
 _flush_output()
 {
@@ -126,6 +214,9 @@ platform_t vmd_platform_alsa = {
 	.enum_devices = _enum_devices,
 	.set_device = _set_device,
 	.output = _output,
+	.output_batch = _output_batch,
+	.output_at = _output_at,
+	.drop_output = _drop_output,
 	.flush_output = _flush_output,
 	.name = "alsa"
 };
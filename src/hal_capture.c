@@ -0,0 +1,78 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * hal_capture.c
+ * an output device that records what it gets to a file
+ *
+ * "capture/<path>" writes "VMDC" and then a record per event: the time since
+ * the device was set in nanoseconds (8 bytes, big-endian), the length of the
+ * event (1 byte) and the event itself.
+ */
+
+#include <stdio.h>
+#include "vomid_local.h"
+
+static FILE *f;
+static systime_t start;
+
+static void
+close_capture()
+{
+	if (f != NULL) {
+		fclose(f);
+		f = NULL;
+	}
+}
+
+static void
+_fini()
+{
+	close_capture();
+}
+
+static status_t
+_set_device(int type, const char *path)
+{
+	if (type != OUTPUT_DEVICE)
+		return ERROR;
+	close_capture();
+	if (path == NULL)
+		return OK;
+
+	f = fopen(path, "wb");
+	if (f == NULL)
+		return ERROR;
+	fwrite("VMDC", 1, 4, f);
+	start = systime();
+	return OK;
+}
+
+static void
+_output(const uchar *ev, size_t size)
+{
+	if (f == NULL || size > 0xFF)
+		return;
+
+	uint64_t ns = (uint64_t)((systime() - start) * 1000 * 1000 * 1000);
+	uchar rec[9];
+	for (int i = 0; i < 8; i++)
+		rec[i] = (uchar)(ns >> (56 - 8 * i));
+	rec[8] = (uchar)size;
+	fwrite(rec, 1, sizeof(rec), f);
+	fwrite(ev, 1, size, f);
+}
+
+static void
+_flush_output()
+{
+	if (f != NULL)
+		fflush(f);
+}
+
+platform_t vmd_platform_capture = {
+	.fini = _fini,
+	.set_device = _set_device,
+	.output = _output,
+	.flush_output = _flush_output,
+	.name = "capture"
+};
@@ -0,0 +1,71 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * hal_null.c
+ * an output device that drops everything it gets, keeping count
+ */
+
+#include <memory.h> /* memset */
+#include "vomid_local.h"
+
+static null_stats_t stats;
+
+static void
+got(unsigned long events)
+{
+	systime_t t = systime();
+	if (stats.events == 0)
+		stats.first = t;
+	stats.last = t;
+	stats.events += events;
+}
+
+static void
+_enum_devices(int type, device_clb_t clb, void *arg)
+{
+	if (type == OUTPUT_DEVICE)
+		clb("null/", "Null output", arg);
+}
+
+static status_t
+_set_device(int type, const char *id)
+{
+	if (type != OUTPUT_DEVICE)
+		return ERROR;
+	memset(&stats, 0, sizeof(stats));
+	return OK;
+}
+
+static void
+_output(const uchar *ev, size_t size)
+{
+	got(1);
+}
+
+static void
+_output_batch(const uchar *const *evs, const size_t *sizes, size_t n)
+{
+	stats.batches++;
+	got(n);
+}
+
+static void
+_flush_output()
+{
+	stats.flushes++;
+}
+
+void
+null_stats(null_stats_t *s)
+{
+	*s = stats;
+}
+
+platform_t vmd_platform_null = {
+	.enum_devices = _enum_devices,
+	.set_device = _set_device,
+	.output = _output,
+	.output_batch = _output_batch,
+	.flush_output = _flush_output,
+	.name = "null"
+};
@@ -6,16 +6,80 @@
 
 #ifdef HAL_POSIX
 
+#define _DEFAULT_SOURCE
 #define _BSD_SOURCE
+#include <errno.h> /* EINTR */
 #include <sys/time.h> /* gettimeofday */
+#include <time.h> /* clock_nanosleep */
 #include <unistd.h> /* usleep */
 #include "vomid_local.h"
 
+#ifdef HAVE_CLOCK_NANOSLEEP
+
+/*
+ * time is read from CLOCK_MONOTONIC_RAW, which NTP doesn't slew, where there
+ * is one. clock_nanosleep() can't sleep on that, so sleeps are on
+ * CLOCK_MONOTONIC, which runs at nearly the same rate.
+ */
+#ifdef CLOCK_MONOTONIC_RAW
+# define CLOCK CLOCK_MONOTONIC_RAW
+#else
+# define CLOCK CLOCK_MONOTONIC
+#endif
+
+static systime_t
+seconds(const struct timespec *ts)
+{
+	return ts->tv_sec + (systime_t)ts->tv_nsec / (1000 * 1000 * 1000);
+}
+
+void
+sleep(systime_t t)
+{
+	if (t <= 0)
+		return;
+
+	struct timespec ts;
+	ts.tv_sec = t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1000 * 1000 * 1000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+void
+sleep_abs(systime_t t)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	systime_t until = seconds(&ts) + (t - systime());
+
+	ts.tv_sec = until;
+	ts.tv_nsec = (long)((until - ts.tv_sec) * 1000 * 1000 * 1000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+systime_t
+systime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK, &ts);
+	return seconds(&ts);
+}
+
+#else /* HAVE_CLOCK_NANOSLEEP */
+
 void
 sleep(systime_t t)
 {
-	//TODO: nanosleep? usleep isn't in latest POSIX std
-	usleep((unsigned int)(t * 1000 * 1000));
+	if (t > 0)
+		usleep((unsigned int)(t * 1000 * 1000));
+}
+
+void
+sleep_abs(systime_t t)
+{
+	sleep(t - systime());
 }
 
 systime_t
@@ -26,6 +90,8 @@ systime()
 	return tv.tv_sec + (systime_t)tv.tv_usec / (1000 * 1000);
 }
 
+#endif /* HAVE_CLOCK_NANOSLEEP */
+
 platform_t vmd_platform_posix = {
 	.name = "posix"
 };
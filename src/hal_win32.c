@@ -32,6 +32,12 @@ sleep(systime_t t)
 	Sleep((DWORD)(t * 1000));
 }
 
+void
+sleep_abs(systime_t t)
+{
+	sleep(t - systime());
+}
+
 systime_t
 systime()
 {
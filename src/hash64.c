@@ -0,0 +1,86 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * hash64.c
+ * fast non-cryptographic 64-bit hash, MurmurHash64A made incremental
+ * (the length is mixed in at the end instead of at the start)
+ */
+
+#include <memory.h> /* memcpy */
+#include "vomid_local.h"
+
+#define M 0xc6a4a7935bd1e995ULL
+#define R 47
+#define SEED 0x766f6d6964ULL /* "vomid" */
+
+static uint64_t
+read_word(const uchar *p)
+{
+	uint64_t w = 0;
+	for (int i = 7; i >= 0; i--)
+		w = w << 8 | p[i];
+	return w;
+}
+
+static uint64_t
+mix(uint64_t h, uint64_t k)
+{
+	k *= M;
+	k ^= k >> R;
+	k *= M;
+
+	h ^= k;
+	h *= M;
+	return h;
+}
+
+void
+hash64_init(hash64_t *hash)
+{
+	hash->h = SEED;
+	hash->len = 0;
+}
+
+void
+hash64_update(hash64_t *hash, const void *data, size_t size)
+{
+	const uchar *p = data, *e = p + size;
+	int tail = hash->len % 8;
+
+	hash->len += size;
+	if (tail != 0) {
+		size_t n = MIN(8 - tail, (size_t)(e - p));
+		memcpy(hash->tail + tail, p, n);
+		p += n;
+		if (tail + n < 8)
+			return;
+		hash->h = mix(hash->h, read_word(hash->tail));
+	}
+
+	for (; e - p >= 8; p += 8)
+		hash->h = mix(hash->h, read_word(p));
+	memcpy(hash->tail, p, e - p);
+}
+
+void
+hash64_final(hash64_t *hash, uchar digest[HASH64_SIZE])
+{
+	uint64_t h = hash->h ^ hash->len * M;
+	int tail = hash->len % 8;
+
+	if (tail != 0) {
+		for (int i = tail - 1; i >= 0; i--)
+			h ^= (uint64_t)hash->tail[i] << (8 * i);
+		h *= M;
+	}
+
+	h ^= h >> R;
+	h *= M;
+	h ^= h >> R;
+
+	/* big-endian, like everything else in SMF */
+	for (int i = HASH64_SIZE - 1; i >= 0; i--) {
+		digest[i] = h & 0xFF;
+		h >>= 8;
+	}
+}
@@ -5,15 +5,67 @@
  * importing an SMF file
  */
 
+#include "config.h"
+#ifdef HAVE_MMAP
+# define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdlib.h> /* malloc */
 #include <memory.h> /* memset */
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+# include <fcntl.h> /* open */
+# include <sys/mman.h> /* mmap */
+# include <sys/stat.h> /* fstat */
+# include <unistd.h> /* close */
+#endif
 #include "vomid_local.h"
 #include "3rdparty/sha1/sha1.h"
 
 #define ZERO_DTIME 1
+#define HASH_STEP 4096 /* as in export */
 
 #define note_offed mark
 
+/*
+ * Tracks are imported in two passes. parse_track() decodes a chunk and pairs
+ * note ons with note offs into a list of events; it only touches the track's
+ * own state, so several tracks may be parsed at once. apply_track() then
+ * replays the events into the file, track by track, in the order they were
+ * read, so the result does not depend on the number of threads.
+ */
+
+enum {
+	EV_NOTE,
+	EV_OFF,
+	EV_CCTRL,
+	EV_META
+};
+
+typedef struct event_t {
+	int type;
+	time_t time;
+	union {
+		struct {
+			time_t on_time;
+			pitch_t pitch;
+			uchar channel, midipitch, on_vel, off_vel, offed;
+		} note;
+		struct {
+			uchar channel, midipitch, vel, offed;
+		} off;
+		struct {
+			int channel, ctrl, value;
+		} cctrl;
+		struct {
+			int type, len;
+			const uchar *data;
+		} meta;
+	} u;
+} event_t;
+
 typedef struct noteon_t {
 	time_t time;
 	pitch_t pitch;
@@ -28,28 +80,60 @@ typedef struct noteoff_t {
 	uchar offed:1;
 } noteoff_t;
 
+typedef struct track_ctx_t {
+	const uchar *chunk;
+	int len;
+
+	event_t *ev;
+	int events, max_events;
+	int drums, nodrums;
+	bool_t failed; /* ran out of memory while parsing */
+
+	/* the HASH64 digest of the chunk, taken as it's parsed */
+	int hash_len; /* bytes covered, -1 if the chunk isn't hashed here */
+	const uchar *hashed;
+	hash64_t hash;
+	uchar digest[HASH64_SIZE];
+} track_ctx_t;
+
+typedef struct parse_ctx_t {
+	track_ctx_t *track;
+	time_t time;
+
+	noteon_t on[CHANNELS][NOTES];
+	pitch_t pitch;
+} parse_ctx_t;
+
+/* a chunk as seen by the checksum; data is NULL for skipped chunks */
+typedef struct span_t {
+	const uchar *header;
+	const uchar *data;
+	int len;
+	bool_t last;
+} span_t;
+
 typedef struct import_ctx_t {
 	file_t *file;
 	track_t *track;
 	time_t time;
 
-	noteon_t on[CHANNELS][NOTES];
 	stack_t offs;
-
-	pitch_t pitch;
-	int drums, nodrums;
+	buf_t spans;
 
 	unsigned char sha[SHA1_SIZE];
 	bool_t sha_specified;
-	SHA_CTX sha_ctx;
+	unsigned char hash64[HASH64_SIZE];
+	bool_t hash64_specified;
 } import_ctx_t;
 
+static int import_threads = 1;
+
 static int
-read_varlen(uchar **_s, uchar *e)
+read_varlen(const uchar **_s, const uchar *e)
 {
 	time_t t = 0;
 
-	for (uchar *s = *_s; s < e; ) {
+	for (const uchar *s = *_s; s < e; ) {
 		uchar b = *s++;
 
 		if (b < 0x80) {
@@ -67,9 +151,9 @@ read_varlen(uchar **_s, uchar *e)
 }
 
 static int
-read_int(void *buf, int len)
+read_int(const void *buf, int len)
 {
-	uchar *b = buf;
+	const uchar *b = buf;
 	int ret = 0;
 
 	for (int i = 0; i < len; i++) {
@@ -80,181 +164,153 @@ read_int(void *buf, int len)
 	return ret;
 }
 
-static void *
-off_clb(note_t *note, void *_arg)
+/* returns the type of a libvomid proprietary event, or -1 */
+static int
+vomid_type(const uchar *data, int len)
 {
-	noteoff_t *arg = _arg;
-	if (note->midipitch != arg->midipitch)
-		return NULL;
+	size_t s = sizeof(magic_vomid);
 
-	if (arg->time < note->off_time || note->note_offed < arg->offed) {
-		note_t n = *note;
-		n.off_time = arg->time;
-		n.off_vel = arg->vel;
+	if (len > s && !memcmp(data, magic_vomid, s))
+		return data[s];
+	return -1;
+}
 
-		erase_note(note);
-		if (n.on_time != n.off_time)
-			insert_note(&n)->note_offed = arg->offed;
+/* first pass */
+
+/* returns NULL and marks the track failed if there's no memory for it */
+static event_t *
+push_event(parse_ctx_t *ctx, int type)
+{
+	track_ctx_t *t = ctx->track;
+
+	if (t->events == t->max_events) {
+		int max_events = MAX(t->max_events * 2, 256);
+		event_t *ev = realloc(t->ev, max_events * sizeof(event_t));
+		if (ev == NULL) {
+			t->failed = TRUE;
+			return NULL;
+		}
+		t->ev = ev;
+		t->max_events = max_events;
 	}
-	return arg;
+
+	event_t *ev = &t->ev[t->events++];
+	ev->type = type;
+	ev->time = ctx->time;
+	return ev;
 }
 
 static void
-off(channel_t *channel, midipitch_t midipitch, uchar vel, int offed, import_ctx_t *ctx)
+off(int channel, midipitch_t midipitch, uchar vel, int offed, parse_ctx_t *ctx)
 {
-	noteon_t *on = &ctx->on[channel->number][midipitch];
+	noteon_t *on = &ctx->on[channel][midipitch];
 
 	if (on->vel != 0) {
-		note_t n = {
-			.track = ctx->track,
-			.channel = channel,
-
-			.on_time = on->time,
-			.on_vel = on->vel,
-
-			.off_time = ctx->time,
-			.off_vel = vel,
-
-			.pitch = on->pitch,
-			.midipitch = midipitch,
-		};
-
-		if (n.on_time != n.off_time)
-			insert_note(&n)->note_offed = offed;
-
+		if (on->time != ctx->time) {
+			event_t *ev = push_event(ctx, EV_NOTE);
+			if (ev == NULL)
+				return;
+			ev->u.note.on_time = on->time;
+			ev->u.note.pitch = on->pitch;
+			ev->u.note.channel = channel;
+			ev->u.note.midipitch = midipitch;
+			ev->u.note.on_vel = on->vel;
+			ev->u.note.off_vel = vel;
+			ev->u.note.offed = offed;
+		}
 		on->vel = 0;
 	} else {
-		noteoff_t off = {
-			.channel = channel,
-			.time = ctx->time,
-			.midipitch = midipitch,
-			.vel = vel,
-			.offed = offed
-		};
-
-		if (channel_range(channel, ctx->time - 1, ctx->time, off_clb, &off) == NULL)
-			stack_push(&ctx->offs, &off);
+		event_t *ev = push_event(ctx, EV_OFF);
+		if (ev == NULL)
+			return;
+		ev->u.off.channel = channel;
+		ev->u.off.midipitch = midipitch;
+		ev->u.off.vel = vel;
+		ev->u.off.offed = offed;
 	}
 }
 
 static void
-v_note_off(channel_t *channel, uchar *data, import_ctx_t *ctx)
+cctrl(int channel, int ctrl, int value, parse_ctx_t *ctx)
+{
+	event_t *ev = push_event(ctx, EV_CCTRL);
+	if (ev == NULL)
+		return;
+	ev->u.cctrl.channel = channel;
+	ev->u.cctrl.ctrl = ctrl;
+	ev->u.cctrl.value = value;
+}
+
+static void
+v_note_off(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 	off(channel, data[0], data[1], 1, ctx);
 }
 
 static void
-v_note_on(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_note_on(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 	off(channel, data[0], DEFAULT_VELOCITY, 0, ctx);
 
 	if (data[1] != 0) {
-		noteon_t *on = &ctx->on[channel->number][data[0]];
+		noteon_t *on = &ctx->on[channel][data[0]];
 
 		on->time = ctx->time;
 		on->vel = data[1];
 		on->pitch = ctx->pitch >= 0 ? ctx->pitch : data[0];
 
 		ctx->pitch = -1;
-		if ((1 << channel->number) & CHANMASK_DRUMS)
-			ctx->drums++;
+		if ((1 << channel) & CHANMASK_DRUMS)
+			ctx->track->drums++;
 		else
-			ctx->nodrums++;
+			ctx->track->nodrums++;
 	}
 }
 
 static void
-v_note_aftertouch(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_note_aftertouch(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 }
 
 static void
-v_controller(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_controller(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 	uchar ctrl = data[0];
 	uchar value = data[1];
 
-	map_set(&channel->ctrl[ctrl], ctx->time, value);
+	cctrl(channel, ctrl, value, ctx);
 }
 
 static void
-v_program(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_program(int channel, const uchar *data, parse_ctx_t *ctx)
 {
-	map_set(&channel->ctrl[CCTRL_PROGRAM], ctx->time, data[0]);
+	cctrl(channel, CCTRL_PROGRAM, data[0], ctx);
 }
 
 static void
-v_channel_pressure(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_channel_pressure(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 }
 
 static void
-v_pitch_wheel(channel_t *channel, uchar *data, import_ctx_t *ctx)
+v_pitch_wheel(int channel, const uchar *data, parse_ctx_t *ctx)
 {
 	//TODO: sensitivity
 	int value = (data[0] + data[1] * 128) - 0x2000;
 
-	map_set(&channel->ctrl[CCTRL_PITCHWHEEL], ctx->time, value);
+	cctrl(channel, CCTRL_PITCHWHEEL, value, ctx);
 }
 
 static void
-m_eot(uchar *data, int len, import_ctx_t *ctx)
+eot(parse_ctx_t *ctx)
 {
 	for (int i = 0; i < CHANNELS; i++)
 		for (int j = 0; j < NOTES; j++)
 			if (ctx->on[i][j].vel != 0)
-				off(&ctx->file->channel[i], j, DEFAULT_VELOCITY, 0, ctx);
-}
-
-static void
-m_trackname(uchar *data, int len, import_ctx_t *ctx)
-{
-	if (ctx->track->name[0] == '\0') {
-		char *trackname = pool_alloc(&ctx->file->pool, len + 1);
-		memcpy(trackname, data, len);
-		trackname[len] = '\0';
-		ctx->track->name = trackname;
-	}
-}
-
-static void
-m_vomid(uchar *data, int len, import_ctx_t *ctx)
-{
-	len--;
-	switch (*data++) {
-	case PROPR_NOTESYSTEM:
-		if (notesystem_is_midistd(&ctx->track->notesystem)) {
-			FILE *f = tmpfile();
-			fwrite(data, 1, len, f);
-			notesystem_t ns = notesystem_import_f(f);
-			if (ns.pitches != NULL)
-				track_set_notesystem(ctx->track, ns);
-			fclose(f);
-		}
-		break;
-	case PROPR_PITCH:
-		if (len >= 2 && ctx->pitch < 0)
-			ctx->pitch = read_int(data, 2);
-		break;
-	case PROPR_SHA:
-		if (len == SHA1_SIZE && !ctx->sha_specified) {
-			ctx->sha_specified = TRUE;
-			memcpy(ctx->sha, data, SHA1_SIZE);
-		}
-		break;
-	}
-}
-
-static void
-m_proprietary(uchar *data, int len, import_ctx_t *ctx)
-{
-	size_t s = sizeof(magic_vomid);
-
-	if (len >= s && !memcmp(data, magic_vomid, s))
-		m_vomid(data + s, len - s, ctx);
+				off(i, j, DEFAULT_VELOCITY, 0, ctx);
 }
 
-typedef void (*voice_handler_t)(channel_t *channel, uchar *data, import_ctx_t *ctx);
+typedef void (*voice_handler_t)(int channel, const uchar *data, parse_ctx_t *ctx);
 
 typedef struct voice_info_t {
 	int len;
@@ -271,51 +327,68 @@ static voice_info_t voice_info[7] = {
 	{2, v_pitch_wheel},
 };
 
-typedef void (*meta_handler_t)(uchar *data, int len, import_ctx_t *ctx);
-
-static meta_handler_t meta_info[METAS] = {
-	[META_TRACKNAME] = m_trackname,
-	[META_EOT] = m_eot,
-	[META_PROPRIETARY] = m_proprietary,
-};
-
 static void
-meta(int type, uchar *data, int len, import_ctx_t *ctx)
+parse_meta(int type, const uchar *data, int len, parse_ctx_t *ctx)
 {
-	meta_handler_t specific_handler = meta_info[type];
-	if (specific_handler != NULL) {
-		specific_handler(data, len, ctx);
+	if (type == META_EOT) {
+		eot(ctx);
 		return;
 	}
 
-	if (fctrl_info[type].read == NULL) {
-		/* not supported */
+	if (type == META_PROPRIETARY && vomid_type(data, len) == PROPR_PITCH) {
+		int s = sizeof(magic_vomid) + 1;
+		if (len - s >= 2 && ctx->pitch < 0)
+			ctx->pitch = read_int(data + s, 2);
 		return;
 	}
 
-	int value = fctrl_info[type].read(data, len);
-	map_set(&ctx->file->ctrl[type], ctx->time, value);
+	event_t *ev = push_event(ctx, EV_META);
+	if (ev == NULL)
+		return;
+	ev->u.meta.type = type;
+	ev->u.meta.data = data;
+	ev->u.meta.len = len;
 }
 
-/* TODO: error handling */
 static void
-import_track(file_t *file, uchar *chunk, int len, import_ctx_t *ctx)
+hash_chunk(track_ctx_t *track, const uchar *upto)
 {
-	track_t *track = track_create(file, 0);
-	if (track == NULL)
+	upto = MIN(upto, track->chunk + track->hash_len);
+	if (upto > track->hashed) {
+		hash64_update(&track->hash, track->hashed, upto - track->hashed);
+		track->hashed = upto;
+	}
+}
+
+static void
+parse_track(track_ctx_t *track)
+{
+	parse_ctx_t *ctx = malloc(sizeof(parse_ctx_t));
+	if (ctx == NULL) {
+		track->failed = TRUE;
 		return;
-	file->track[file->tracks++] = track;
+	}
 
+	memset(ctx->on, 0, sizeof(ctx->on));
 	ctx->track = track;
 	ctx->time = 0;
-	memset(ctx->on, 0, sizeof(ctx->on));
 	ctx->pitch = -1;
-	ctx->drums = ctx->nodrums = 0;
-	ctx->sha_specified = FALSE;
 
-	uchar *end = chunk + len;
+	const uchar *chunk = track->chunk;
+	const uchar *end = chunk + track->len;
 	uchar runst = 0;
-	while (chunk < end) {
+
+	bool_t hash = track->hash_len >= 0;
+	if (hash) {
+		hash64_init(&track->hash);
+		track->hashed = chunk;
+	}
+
+	while (chunk < end && !track->failed) {
+		/* while the bytes are still in the cache */
+		if (hash && chunk - track->hashed >= HASH_STEP)
+			hash_chunk(track, chunk);
+
 		/* time */
 		time_t dt = read_varlen(&chunk, end);
 		if (dt < 0 || ctx->time + dt < ctx->time || chunk >= end)
@@ -350,21 +423,23 @@ import_track(file_t *file, uchar *chunk, int len, import_ctx_t *ctx)
 			if (end - chunk < len)
 				break;
 
-			meta(type, chunk, len, ctx);
+			parse_meta(type, chunk, len, ctx);
 		} else if (st >= 0x80 && st < 0xF0) {
 			runst = st;
 			int idx = (st - 0x80) / 0x10;
 			int channel = st & 0xF;
 
 			len = voice_info[idx].len;
+			if (end - chunk < len)
+				goto eot;
 			for (int i = 0; i < len; i++)
-				if ((uchar)chunk[0] >= 0x80)
+				if ((uchar)chunk[i] >= 0x80)
 					goto eot;
 
 			voice_handler_t handler = voice_info[idx].handler;
 
 			if (handler != NULL)
-				handler(&file->channel[channel], chunk, ctx);
+				handler(channel, chunk, ctx);
 		} else {
 			/* should not get here */
 			break;
@@ -372,62 +447,366 @@ import_track(file_t *file, uchar *chunk, int len, import_ctx_t *ctx)
 		chunk += len;
 	}
 eot:
-	m_eot(NULL, 0, ctx);
-	if (ctx->drums > 0)
+	if (hash) {
+		hash_chunk(track, track->chunk + track->hash_len);
+		hash64_final(&track->hash, track->digest);
+	}
+	eot(ctx);
+	free(ctx);
+}
+
+#ifdef HAVE_PTHREADS
+typedef struct parse_pool_t {
+	track_ctx_t *tracks;
+	int count, next;
+	pthread_mutex_t mutex;
+} parse_pool_t;
+
+static void *
+parse_worker(void *arg)
+{
+	parse_pool_t *pool = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		int i = pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (i >= pool->count)
+			return NULL;
+		parse_track(&pool->tracks[i]);
+	}
+}
+#endif
+
+static status_t
+parsed(track_ctx_t *tracks, int count)
+{
+	for (int i = 0; i < count; i++)
+		if (tracks[i].failed)
+			return ERROR;
+	return OK;
+}
+
+static status_t
+parse_tracks(track_ctx_t *tracks, int count)
+{
+#ifdef HAVE_PTHREADS
+	int threads = MIN(import_threads, count);
+
+	if (threads > 1) {
+		parse_pool_t pool = {
+			.tracks = tracks,
+			.count = count,
+			.next = 0,
+		};
+		pthread_t *thread = malloc((threads - 1) * sizeof(pthread_t));
+		int started = 0;
+
+		pthread_mutex_init(&pool.mutex, NULL);
+		if (thread != NULL)
+			while (started < threads - 1 && pthread_create(&thread[started], NULL, parse_worker, &pool) == 0)
+				started++;
+
+		/* the calling thread takes its share, and everything left over
+		 * if some of the workers could not be started */
+		parse_worker(&pool);
+
+		for (int i = 0; i < started; i++)
+			pthread_join(thread[i], NULL);
+		pthread_mutex_destroy(&pool.mutex);
+		free(thread);
+		return parsed(tracks, count);
+	}
+#endif
+	for (int i = 0; i < count; i++)
+		parse_track(&tracks[i]);
+	return parsed(tracks, count);
+}
+
+/* second pass */
+
+static void *
+off_clb(note_t *note, void *_arg)
+{
+	noteoff_t *arg = _arg;
+	if (note->midipitch != arg->midipitch)
+		return NULL;
+
+	if (arg->time < note->off_time || note->note_offed < arg->offed) {
+		note_t n = *note;
+		n.off_time = arg->time;
+		n.off_vel = arg->vel;
+
+		erase_note(note);
+		if (n.on_time != n.off_time)
+			insert_note(&n)->note_offed = arg->offed;
+	}
+	return arg;
+}
+
+static void
+m_trackname(const uchar *data, int len, import_ctx_t *ctx)
+{
+	if (ctx->track->name[0] == '\0') {
+		char *trackname = pool_alloc(&ctx->file->pool, len + 1);
+		memcpy(trackname, data, len);
+		trackname[len] = '\0';
+		ctx->track->name = trackname;
+	}
+}
+
+static void
+m_vomid(const uchar *data, int len, import_ctx_t *ctx)
+{
+	len--;
+	switch (*data++) {
+	case PROPR_NOTESYSTEM:
+		if (notesystem_is_midistd(&ctx->track->notesystem)) {
+			FILE *f = tmpfile();
+			fwrite(data, 1, len, f);
+			notesystem_t ns = notesystem_import_f(f);
+			if (ns.pitches != NULL)
+				track_set_notesystem(ctx->track, ns);
+			fclose(f);
+		}
+		break;
+	case PROPR_SHA:
+		if (len == SHA1_SIZE && !ctx->sha_specified) {
+			ctx->sha_specified = TRUE;
+			memcpy(ctx->sha, data, SHA1_SIZE);
+		}
+		break;
+	case PROPR_HASH64:
+		if (len == HASH64_SIZE && !ctx->hash64_specified) {
+			ctx->hash64_specified = TRUE;
+			memcpy(ctx->hash64, data, HASH64_SIZE);
+		}
+		break;
+	}
+}
+
+static void
+m_proprietary(const uchar *data, int len, import_ctx_t *ctx)
+{
+	size_t s = sizeof(magic_vomid);
+
+	if (vomid_type(data, len) >= 0)
+		m_vomid(data + s, len - s, ctx);
+}
+
+typedef void (*meta_handler_t)(const uchar *data, int len, import_ctx_t *ctx);
+
+static meta_handler_t meta_info[METAS] = {
+	[META_TRACKNAME] = m_trackname,
+	[META_PROPRIETARY] = m_proprietary,
+};
+
+static void
+meta(int type, const uchar *data, int len, import_ctx_t *ctx)
+{
+	meta_handler_t specific_handler = meta_info[type];
+	if (specific_handler != NULL) {
+		specific_handler(data, len, ctx);
+		return;
+	}
+
+	if (fctrl_info[type].read == NULL) {
+		/* not supported */
+		return;
+	}
+
+	int value = fctrl_info[type].read(data, len);
+	map_set(&ctx->file->ctrl[type], ctx->time, value);
+}
+
+/* TODO: error handling */
+static void
+apply_track(file_t *file, track_ctx_t *t, import_ctx_t *ctx)
+{
+	track_t *track = track_create(file, 0);
+	if (track == NULL)
+		return;
+	file->track[file->tracks++] = track;
+
+	ctx->track = track;
+	ctx->sha_specified = FALSE;
+	ctx->hash64_specified = FALSE;
+
+	for (event_t *ev = t->ev; ev < t->ev + t->events; ev++) {
+		ctx->time = ev->time;
+
+		switch (ev->type) {
+		case EV_NOTE: {
+			note_t n = {
+				.track = track,
+				.channel = &file->channel[ev->u.note.channel],
+
+				.on_time = ev->u.note.on_time,
+				.on_vel = ev->u.note.on_vel,
+
+				.off_time = ev->time,
+				.off_vel = ev->u.note.off_vel,
+
+				.pitch = ev->u.note.pitch,
+				.midipitch = ev->u.note.midipitch,
+			};
+
+			insert_note(&n)->note_offed = ev->u.note.offed;
+			break;
+		}
+		case EV_OFF: {
+			noteoff_t off = {
+				.channel = &file->channel[ev->u.off.channel],
+				.time = ev->time,
+				.midipitch = ev->u.off.midipitch,
+				.vel = ev->u.off.vel,
+				.offed = ev->u.off.offed
+			};
+
+			if (channel_range(off.channel, off.time - 1, off.time, off_clb, &off) == NULL)
+				stack_push(&ctx->offs, &off);
+			break;
+		}
+		case EV_CCTRL:
+			map_set(channel_ctrl(&file->channel[ev->u.cctrl.channel], ev->u.cctrl.ctrl), ev->time, ev->u.cctrl.value);
+			break;
+		case EV_META:
+			meta(ev->u.meta.type, ev->u.meta.data, ev->u.meta.len, ctx);
+			break;
+		}
+	}
+
+	if (t->drums > 0)
 		track->chanmask = CHANMASK_DRUMS;
 	else
 		track->chanmask = CHANMASK_NODRUMS;
 }
 
 static int
-read_chunk(FILE *f, const uchar magic[4], uchar **_chunk, int *_len, SHA_CTX *sha_ctx, vmd_bool_t last)
+read_chunk(const uchar **_p, const uchar *end, const uchar magic[4], const uchar **_chunk, int *_len, buf_t *spans, vmd_bool_t last)
 {
-	uchar header[8], *chunk;
+	const uchar *p = *_p;
 	int len;
 
 start:
-	if (fread(header, 1, sizeof(header), f) != sizeof(header))
+	if (end - p < CHUNK_HEADER_SIZE)
 		return ERROR;
-	SHA1_Update(sha_ctx, header, sizeof(header));
+	span_t span = {
+		.header = p,
+	};
 
-	len = read_int(header + 4, 4);
-	if (memcmp(header, magic, 4) != 0) {
-		if (fseek(f, len, SEEK_CUR) != 0)
-			return ERROR;
+	len = read_int(p + 4, 4);
+	if (len < 0 || end - p - CHUNK_HEADER_SIZE < len)
+		return ERROR;
+	if (memcmp(p, magic, 4) != 0) {
+		buf_write(spans, &span, sizeof(span));
+		p += CHUNK_HEADER_SIZE + len;
 		goto start;
 	}
 
-	chunk = malloc(len);
-	if (chunk == NULL)
-		return ERROR;
-
-	if (fread(chunk, 1, len, f) != len) {
-		free(chunk);
-		return ERROR;
-	}
+	span.data = *_chunk = p + CHUNK_HEADER_SIZE;
+	span.len = *_len = len;
+	span.last = last;
+	buf_write(spans, &span, sizeof(span));
+	*_p = p + CHUNK_HEADER_SIZE + len;
+	return OK;
+}
 
-	*_chunk = chunk;
-	*_len = len;
+/* the checksum event and the eot at the end of the last track aren't covered */
+static int
+hashed_len(int len, bool_t last, int digest_size)
+{
 	if (last) {
-		len -= ZERO_DTIME + META_HEADER_SIZE + PROPR_HEADER_SIZE + SHA1_SIZE; /* sha */
-		len -= ZERO_DTIME + META_HEADER_SIZE;                                 /* eot */
+		len -= ZERO_DTIME + META_HEADER_SIZE + PROPR_HEADER_SIZE + digest_size;
+		len -= ZERO_DTIME + META_HEADER_SIZE; /* eot */
 	}
-	if (len >= 0)
-		SHA1_Update(sha_ctx, chunk, len);
-	return OK;
+	return len;
 }
 
 static bool_t
 check_sha(import_ctx_t *ctx)
 {
-	if (!ctx->sha_specified)
-		return FALSE;
+	const span_t *span = (const span_t *)ctx->spans.data;
+	size_t spans = ctx->spans.size / sizeof(span_t);
+	SHA_CTX sha_ctx;
+
+	SHA1_Init(&sha_ctx);
+	for (size_t i = 0; i < spans; i++) {
+		SHA1_Update(&sha_ctx, span[i].header, CHUNK_HEADER_SIZE);
+
+		int len = hashed_len(span[i].len, span[i].last, SHA1_SIZE);
+		if (span[i].data != NULL && len >= 0)
+			SHA1_Update(&sha_ctx, span[i].data, len);
+	}
 
 	uchar sha[SHA1_SIZE];
-	SHA1_Final(sha, &ctx->sha_ctx);
+	SHA1_Final(sha, &sha_ctx);
 	return !memcmp(ctx->sha, sha, sizeof(sha));
 }
 
+/* does the last track end with a HASH64 checksum, as export writes it? */
+static bool_t
+ends_with_hash64(const track_ctx_t *t)
+{
+	int len = hashed_len(t->len, TRUE, HASH64_SIZE);
+	if (len < 0)
+		return FALSE;
+
+	const uchar *ev = t->chunk + len + ZERO_DTIME;
+	int size = PROPR_HEADER_SIZE + HASH64_SIZE;
+	return ev[0] == 0xFF && ev[1] == META_PROPRIETARY && ev[2] == size &&
+		vomid_type(ev + META_HEADER_SIZE, size) == PROPR_HASH64;
+}
+
+/*
+ * the header of every chunk, followed by the digest of its contents;
+ * the digests of tracks come from parse_track() where it took them
+ */
+static bool_t
+check_hash64(import_ctx_t *ctx, const track_ctx_t *t, int tracks)
+{
+	const span_t *span = (const span_t *)ctx->spans.data;
+	size_t spans = ctx->spans.size / sizeof(span_t);
+	hash64_t hash, chunk_hash;
+	uchar digest[HASH64_SIZE];
+	int k = -1; /* the first chunk read is the header */
+
+	hash64_init(&hash);
+	for (size_t i = 0; i < spans; i++) {
+		hash64_update(&hash, span[i].header, CHUNK_HEADER_SIZE);
+
+		int len = hashed_len(span[i].len, span[i].last, HASH64_SIZE);
+		if (span[i].data == NULL || len < 0)
+			continue;
+
+		if (k >= 0 && k < tracks && t[k].hash_len >= 0) {
+			hash64_update(&hash, t[k].digest, sizeof(t[k].digest));
+		} else {
+			hash64_init(&chunk_hash);
+			hash64_update(&chunk_hash, span[i].data, len);
+			hash64_final(&chunk_hash, digest);
+			hash64_update(&hash, digest, sizeof(digest));
+		}
+		k++;
+	}
+
+	hash64_final(&hash, digest);
+	return !memcmp(ctx->hash64, digest, sizeof(digest));
+}
+
+static bool_t
+check_checksum(import_ctx_t *ctx, const track_ctx_t *t, int tracks)
+{
+	if (ctx->spans.failed)
+		return FALSE;
+	if (ctx->sha_specified)
+		return check_sha(ctx);
+	if (ctx->hash64_specified)
+		return check_hash64(ctx, t, tracks);
+	return FALSE;
+}
+
 static void
 reset_marks(file_t *file)
 {
@@ -436,51 +815,79 @@ reset_marks(file_t *file)
 			track_note(j)->mark = 0;
 }
 
+void
+set_import_threads(int threads)
+{
+	import_threads = MAX(threads, 1);
+}
+
 status_t
-file_import_f(file_t *file, FILE *f, vmd_bool_t *_sha_ok)
+file_import_mem(file_t *file, const void *data, size_t size, vmd_bool_t *_sha_ok)
 {
-	uchar *chunk;
+	const uchar *p = data, *end = p + size;
+	const uchar *chunk;
 	int len;
 
 	import_ctx_t ctx = {
 		.file = file,
 	};
-	SHA1_Init(&ctx.sha_ctx);
-
-	if (read_chunk(f, magic_mthd, &chunk, &len, &ctx.sha_ctx, FALSE) != OK)
-		return ERROR;
+	buf_init(&ctx.spans);
 
-	if(len < 6) {
-		free(chunk);
+	if (read_chunk(&p, end, magic_mthd, &chunk, &len, &ctx.spans, FALSE) != OK || len < 6) {
+		buf_fini(&ctx.spans);
 		return ERROR;
 	}
 
 	int format = read_int(chunk, 2);
 	int tracks = read_int(chunk + 2, 2);
 	int division = read_int(chunk + 4, 2);
-	free(chunk);
 
 	//TODO: format 0
-	if (format != 1)
-		return ERROR;
-
 	//TODO: negative division
-	if (division < 0)
+	if (format != 1 || division < 0) {
+		buf_fini(&ctx.spans);
 		return ERROR;
+	}
 
 	file_init(file);
 	file->division = division;
 
 	stack_init(&ctx.offs, sizeof(noteoff_t));
 
-	for (int i = 0; i < tracks; i++) {
-		if (read_chunk(f, magic_mtrk, &chunk, &len, &ctx.sha_ctx, i == tracks - 1) != OK) {
-			free(chunk);
+	track_ctx_t *t = calloc(MAX(tracks, 1), sizeof(track_ctx_t));
+	if (t == NULL) {
+		stack_fini(&ctx.offs);
+		buf_fini(&ctx.spans);
+		return ERROR;
+	}
+
+	int read = 0;
+	while (read < tracks) {
+		track_ctx_t *r = &t[read];
+		if (read_chunk(&p, end, magic_mtrk, &r->chunk, &r->len, &ctx.spans, read == tracks - 1) != OK)
 			break;
-		}
+		read++;
+	}
+
+	/* a HASH64 checksum is computed while the tracks are parsed */
+	bool_t hash = read == tracks && read > 0 && ends_with_hash64(&t[read - 1]);
+	for (int i = 0; i < read; i++)
+		t[i].hash_len = hash ? hashed_len(t[i].len, i == read - 1, HASH64_SIZE) : -1;
+
+	if (parse_tracks(t, read) != OK) {
+		for (int i = 0; i < read; i++)
+			free(t[i].ev);
+		free(t);
+		stack_fini(&ctx.offs);
+		buf_fini(&ctx.spans);
+		return ERROR;
+	}
 
-		import_track(file, chunk, len, &ctx);
-		free(chunk);
+	for (int i = 0; i < read; i++) {
+		/* tracks that don't fit are still read for the checksum */
+		if (file->tracks < MAX_TRACKS)
+			apply_track(file, &t[i], &ctx);
+		free(t[i].ev);
 
 		if (i == 0 && bst_empty(&file->track[0]->notes)) {
 			track_destroy(file->track[0]);
@@ -488,8 +895,8 @@ file_import_f(file_t *file, FILE *f, vmd_bool_t *_sha_ok)
 			file->tracks_list = NULL;
 		}
 	}
-	char unused;
-	bool_t trailing_stuff = fread(&unused, 1, 1, f) == 1;
+
+	bool_t trailing_stuff = p < end;
 
 	noteoff_t *off;
 	while ((off = stack_pop(&ctx.offs)) != NULL)
@@ -497,8 +904,76 @@ file_import_f(file_t *file, FILE *f, vmd_bool_t *_sha_ok)
 
 	stack_fini(&ctx.offs);
 	if (_sha_ok != NULL)
-		*_sha_ok = !trailing_stuff && check_sha(&ctx);
+		*_sha_ok = !trailing_stuff && check_checksum(&ctx, t, read);
+	free(t);
+	if (ctx.hash64_specified && !ctx.sha_specified)
+		file->checksum = CHECKSUM_HASH64;
+	buf_fini(&ctx.spans);
 	file->force_compatible = file_is_compatible(file);
 	reset_marks(file);
+	file_regen_measure_index(file);
 	return file->tracks ? OK : ERROR;
 }
+
+status_t
+file_import_f(file_t *file, FILE *f, vmd_bool_t *sha_ok)
+{
+	uchar *data = NULL;
+	size_t size = 0, max_size = 0;
+
+	/* the stream might be a pipe, so it's read till the end */
+	for (;;) {
+		if (size == max_size) {
+			max_size = MAX(max_size * 2, 64 * 1024);
+			uchar *p = realloc(data, max_size);
+			if (p == NULL) {
+				free(data);
+				return ERROR;
+			}
+			data = p;
+		}
+
+		size_t n = fread(data + size, 1, max_size - size, f);
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	status_t ret = file_import_mem(file, data, size, sha_ok);
+	free(data);
+	return ret;
+}
+
+status_t
+file_import_mmap(file_t *file, const char *fn, vmd_bool_t *sha_ok)
+{
+#ifdef HAVE_MMAP
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return ERROR;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return ERROR;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return ERROR;
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	status_t ret = file_import_mem(file, data, st.st_size, sha_ok);
+	munmap(data, st.st_size);
+	return ret;
+#else
+	FILE *f = fopen(fn, "rb");
+	if (f == NULL)
+		return ERROR;
+
+	status_t ret = file_import_f(file, f, sha_ok);
+	fclose(f);
+	return ret;
+#endif
+}
@@ -18,6 +18,24 @@ map_init(map_t *map, int default_value)
 {
 	bst_init(&map->bst, sizeof(map_bstdata_t), sizeof(map_bstdata_t), cmp, NULL);
 	map->default_value = default_value;
+	map->used = NULL;
+	map->used_bit = 0;
+}
+
+void
+map_track_usage(map_t *map, uint64_t *bitmap, int bit)
+{
+	map->used = bitmap + bit / 64;
+	map->used_bit = (uint64_t)1 << (bit % 64);
+	if (!bst_empty(&map->bst))
+		*map->used |= map->used_bit;
+}
+
+static void
+mark_used(map_t *map)
+{
+	if (map->used != NULL)
+		*map->used |= map->used_bit;
 }
 
 void
@@ -46,12 +64,24 @@ map_get(map_t *map, time_t time, time_t *change_time)
 void
 map_set(map_t *map, time_t time, int value)
 {
+	/* events mostly come in time order, so appending is the common case */
+	if (bst_empty(&map->bst) || map_time(bst_prev(bst_end(&map->bst))) < time) {
+		int last = bst_empty(&map->bst) ? map->default_value : map_value(bst_prev(bst_end(&map->bst)));
+		if (last != value) {
+			bst_append_sorted(&map->bst, &(map_bstdata_t){.time = time, .value = value}, 1, sizeof(map_bstdata_t));
+			mark_used(map);
+		}
+		return;
+	}
+
 	bst_node_t *ex = bst_find(&map->bst, &time);
 	if (ex != NULL)
 		bst_erase(&map->bst, ex);
 
-	if (map_get(map, time, NULL) != value)
+	if (map_get(map, time, NULL) != value) {
 		bst_insert(&map->bst, &(map_bstdata_t){.time = time, .value = value});
+		mark_used(map);
+	}
 }
 
 void
@@ -140,6 +170,8 @@ map_copy(map_t *map1, time_t beg1, time_t end1, map_t *map2, time_t beg2)
 			.time = map_time(i) + (beg2 - beg1),
 			.value = map_value(i)
 		});
+	if (s != e)
+		mark_used(map2);
 }
 
 int
@@ -28,13 +28,13 @@ systime2time(double sec, int tempo, unsigned int division)
 }
 
 static int
-read_tempo(uchar *data, int len)
+read_tempo(const uchar *data, int len)
 {
 	return data[0] * 0x10000 + data[1] * 0x100 + data[2];
 }
 
 static int
-read_timesig(uchar *data, int len)
+read_timesig(const uchar *data, int len)
 {
 	return data[0] + data[1] * 0x100;
 }
@@ -135,59 +135,61 @@ midi_write_meta(small_event_t *ev, uchar type, const uchar *data, int len)
 }
 
 void
-midi_fwrite_varlen(FILE *out, time_t time){
+midi_bwrite_varlen(buf_t *out, time_t time)
+{
 	assert(time >= 0);
-	if (time > 0) {
-		uchar buf[32];
-		uchar *s = buf + sizeof(buf);
-		uchar *e = s;
-
-		while (time != 0) {
-			*--s = time % 0x80;
-			if (s != e - 1)
-				*s += 0x80;
-			time /= 0x80;
-		}
-		fwrite(s, 1, e - s, out);
-	} else
-		fputc(0, out);
+
+	int len = 1;
+	for (time_t t = time / 0x80; t != 0; t /= 0x80)
+		len++;
+
+	uchar *s = buf_grow(out, len);
+	if (s == NULL)
+		return;
+
+	for (int i = len - 1; i >= 0; i--) {
+		s[i] = time % 0x80;
+		if (i != len - 1)
+			s[i] += 0x80;
+		time /= 0x80;
+	}
 }
 
 void
-midi_fwrite_meta_header(FILE *out, uchar type, int len)
+midi_bwrite_meta_header(buf_t *out, uchar type, int len)
 {
-	fputc(0xFF, out);
-	fputc(type, out);
-	midi_fwrite_varlen(out, len);
+	buf_putc(out, 0xFF);
+	buf_putc(out, type);
+	midi_bwrite_varlen(out, len);
 }
 
 void
-midi_fwrite_meta(FILE *out, uchar type, const uchar *data, int len)
+midi_bwrite_meta(buf_t *out, uchar type, const uchar *data, int len)
 {
-	midi_fwrite_meta_header(out, type, len);
-	fwrite(data, 1, len, out);
+	midi_bwrite_meta_header(out, type, len);
+	buf_write(out, data, len);
 }
 
 void
-midi_fwrite_propr(FILE *out, uchar type, uchar *data, int s)
+midi_bwrite_propr(buf_t *out, uchar type, const uchar *data, int s)
 {
-	midi_fwrite_meta_header(out, META_PROPRIETARY, PROPR_HEADER_SIZE + s);
-	fwrite(magic_vomid, 1, sizeof(magic_vomid), out);
-	fputc(type, out);
-	fwrite(data, 1, s, out);
+	midi_bwrite_meta_header(out, META_PROPRIETARY, PROPR_HEADER_SIZE + s);
+	buf_write(out, magic_vomid, sizeof(magic_vomid));
+	buf_putc(out, type);
+	buf_write(out, data, s);
 }
 
 void
-midi_fwrite_pitch(FILE *out, pitch_t pitch)
+midi_bwrite_pitch(buf_t *out, pitch_t pitch)
 {
 	assert(pitch >= 0);
-	midi_fwrite_propr(out, PROPR_PITCH, (uchar []){pitch / 0x100, pitch % 0x100}, 2);
+	midi_bwrite_propr(out, PROPR_PITCH, (uchar []){pitch / 0x100, pitch % 0x100}, 2);
 }
 
 void
-midi_fwrite_notesystem(FILE *out, const notesystem_t *ns)
+midi_bwrite_notesystem(buf_t *out, const notesystem_t *ns)
 {
-	midi_fwrite_propr(out, PROPR_NOTESYSTEM, (uchar *)ns->scala, strlen(ns->scala));
+	midi_bwrite_propr(out, PROPR_NOTESYSTEM, (const uchar *)ns->scala, strlen(ns->scala));
 }
 
 ctrl_info_t fctrl_info[FCTRLS] = {
@@ -336,17 +338,40 @@ const char *gm_program_name[PROGRAMS] = {
 void
 notes_off()
 {
-	for (int i = 0; i < CHANNELS; i++)
-		output((uchar []){VOICE_CONTROLLER + i, CTRL_NOTES_OFF, 0}, 3);
+	uchar buf[CHANNELS][3];
+	const uchar *evs[CHANNELS];
+	size_t sizes[CHANNELS];
+
+	for (int i = 0; i < CHANNELS; i++) {
+		buf[i][0] = VOICE_CONTROLLER + i;
+		buf[i][1] = CTRL_NOTES_OFF;
+		buf[i][2] = 0;
+		evs[i] = buf[i];
+		sizes[i] = 3;
+	}
+	output_batch(evs, sizes, CHANNELS);
 	flush_output();
 }
 
 void
 reset_output()
 {
+	uchar buf[CHANNELS][2][3];
+	const uchar *evs[CHANNELS * 2];
+	size_t sizes[CHANNELS * 2];
+
 	for (int i = 0; i < CHANNELS; i++) {
-		output((uchar []){VOICE_CONTROLLER + i, CTRL_CONTROLLERS_OFF, 0}, 3);
-		output((uchar []){VOICE_PROGRAM + i, 0}, 2);
+		buf[i][0][0] = VOICE_CONTROLLER + i;
+		buf[i][0][1] = CTRL_CONTROLLERS_OFF;
+		buf[i][0][2] = 0;
+		evs[i * 2] = buf[i][0];
+		sizes[i * 2] = 3;
+
+		buf[i][1][0] = VOICE_PROGRAM + i;
+		buf[i][1][1] = 0;
+		evs[i * 2 + 1] = buf[i][1];
+		sizes[i * 2 + 1] = 2;
 	}
+	output_batch(evs, sizes, CHANNELS * 2);
 	flush_output();
 }
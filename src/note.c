@@ -12,11 +12,14 @@ insert_note(const note_t *note)
 	bst_node_t *t_node = bst_insert(&note->track->notes, note);
 	note_t *ret = (note_t *)t_node->data;
 	ret->channel = note->channel;
+	track_note_added(ret->track, ret);
 
 	bst_insert(&note->channel->notes, &ret);
 	assert(bst_find(&note->channel->notes, &ret) != NULL);
 	if (note->channel->number >= 0)
 		note->track->channel_usage[note->channel->number]++;
+	else
+		note->track->temp_notes++;
 	return ret;
 }
 
@@ -24,6 +27,7 @@ void
 erase_note(note_t *note)
 {
 	note_set_channel(note, NULL);
+	track_note_removed(note->track, note);
 	bst_erase(&note->track->notes, bst_node(note));
 }
 
@@ -42,10 +46,7 @@ void
 copy_note(note_t *note, track_t *track, time_t dt, pitch_t dp)
 {
 	note_t *dnote = track_insert(track, note->on_time + dt, note->off_time + dt, note->pitch);
-	for (int i = 0; i < CCTRLS; i++) {
-		map_copy(&note->channel->ctrl[i], note->on_time, note->off_time,
-		         &dnote->channel->ctrl[i], dnote->on_time);
-	}
+	channel_copy_ctrls(note->channel, note->on_time, note->off_time, dnote->channel, dnote->on_time);
 	note_set_cctrl(dnote, CCTRL_PROGRAM, track_get_ctrl(track, CCTRL_PROGRAM));
 	note_set_pitch(dnote, note->pitch + dp);
 }
@@ -53,7 +54,7 @@ copy_note(note_t *note, track_t *track, time_t dt, pitch_t dp)
 void
 note_set_cctrl(note_t *note, int cctrl, int value)
 {
-	map_set_range(&note->channel->ctrl[cctrl], note->on_time, note->off_time, value);
+	map_set_range(channel_ctrl(note->channel, cctrl), note->on_time, note->off_time, value);
 }
 
 static int
@@ -75,8 +76,10 @@ note_set_pitch(note_t *note, pitch_t pitch)
 	int dpw = base_pitch(&dnote) - base_pitch(note);
 
 	isolate_note(note);
+	track_note_removed(note->track, note);
 	bst_change(&note->track->notes, bst_node(note), &dnote);
-	map_add(&note->channel->ctrl[CCTRL_PITCHWHEEL], note->on_time, note->off_time, dpw);
+	track_note_added(note->track, note);
+	map_add(channel_ctrl(note->channel, CCTRL_PITCHWHEEL), note->on_time, note->off_time, dpw);
 }
 
 void
@@ -89,14 +92,18 @@ note_set_channel(note_t *note, channel_t *channel)
 
 	if (note->channel->number >= 0)
 		note->track->channel_usage[note->channel->number]--;
-	if (channel != NULL && channel->number >= 0)
-		note->track->channel_usage[channel->number]++;
+	else
+		note->track->temp_notes--;
+	if (channel != NULL) {
+		if (channel->number >= 0)
+			note->track->channel_usage[channel->number]++;
+		else
+			note->track->temp_notes++;
+	}
 
 	if (channel != NULL) {
 		bst_insert(&channel->notes, &note);
-		for (int i = 0; i < CCTRLS; i++)
-			map_copy(&note->channel->ctrl[i], note->on_time, note->off_time,
-					&channel->ctrl[i], note->on_time);
+		channel_copy_ctrls(note->channel, note->on_time, note->off_time, channel, note->on_time);
 	}
 	note->channel = channel;
 }
@@ -130,7 +137,9 @@ note_reset_pitch(note_t *note, pitch_t pitch)
 
 	bst_node_t *channel_node = bst_find(&note->channel->notes, &note);
 	assert(channel_node != NULL);
+	track_note_removed(note->track, note);
 	bst_change(&note->track->notes, bst_node(note), &n1);
+	track_note_added(note->track, note);
 	bst_change(&note->channel->notes, channel_node, NULL);
-	map_set_range(&note->channel->ctrl[CCTRL_PITCHWHEEL], note->on_time, note->off_time, pw);
+	map_set_range(channel_ctrl(note->channel, CCTRL_PITCHWHEEL), note->on_time, note->off_time, pw);
 }
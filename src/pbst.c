@@ -0,0 +1,336 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ */
+
+/**
+ * @file pbst.c
+ * Fully persistent AVL tree.
+ *
+ * @par Features
+ * - O(1) snapshots: pbst_commit() just takes a reference to the root.
+ *   a committed root never changes, so it can be read from other threads
+ *   (playback, export) while the tree is being edited, without any locking.
+ * - structure sharing: an edit copies only the O(log n) nodes on the way
+ *   from the root to where it happens, the rest is shared with older roots.
+ *
+ * @par Implementation notes
+ * - every node counts the parents and committed roots pointing at it.
+ *   a node with a count of 1 reached from tree->root through nodes with
+ *   a count of 1 is only seen by the tree, and gets changed in place;
+ *   anything else is copied first (own()). so between commits,
+ *   edits don't allocate more than a plain AVL tree does.
+ * - counts change atomically, and the last one to let go of a node
+ *   frees it, whichever thread that is.
+ * - unlike bst.c, nodes have no parent pointers (they may have many parents),
+ *   so iterating takes a stack, see pbst_iter_t.
+ * - if a copy can't be allocated during rebalancing, the rotation is skipped.
+ *   the tree stays correct, only less balanced.
+ */
+
+#include <stdlib.h> /* malloc */
+#include <memory.h> /* memcpy */
+#include <assert.h>
+#include "vomid_local.h"
+
+#define REFS(n) __atomic_load_n(&(n)->refs, __ATOMIC_ACQUIRE)
+#define RETAIN(n) __atomic_add_fetch(&(n)->refs, 1, __ATOMIC_RELAXED)
+#define UNRETAIN(n) __atomic_sub_fetch(&(n)->refs, 1, __ATOMIC_ACQ_REL)
+
+static int
+height(const pbst_node_t *node)
+{
+	return node == NULL ? 0 : node->height;
+}
+
+static void
+fix_height(pbst_node_t *node)
+{
+	node->height = MAX(height(node->child[0]), height(node->child[1])) + 1;
+}
+
+static void
+retain(pbst_node_t *node)
+{
+	if (node != NULL)
+		RETAIN(node);
+}
+
+/**
+ * Drop a reference to a root returned by \c pbst_commit().
+ * Nodes nothing else points to are freed.
+ */
+void
+pbst_release(pbst_node_t *node)
+{
+	if (node == NULL || UNRETAIN(node) != 0)
+		return;
+
+	pbst_release(node->child[0]);
+	pbst_release(node->child[1]);
+	free(node);
+}
+
+/* a node the tree may change in place, copied if it's shared */
+static pbst_node_t *
+own(pbst_t *tree, pbst_node_t *node)
+{
+	if (REFS(node) == 1)
+		return node;
+
+	pbst_node_t *copy = malloc(sizeof(pbst_node_t) + tree->dsize);
+	if (copy == NULL)
+		return NULL;
+
+	/* not the count, others may be changing it */
+	for (int i = 0; i < 2; i++) {
+		copy->child[i] = node->child[i];
+		retain(copy->child[i]);
+	}
+	copy->refs = 1;
+	copy->height = node->height;
+	memcpy(copy->data, node->data, tree->dsize);
+	/* the parent points to the copy now; someone else still has the node */
+	pbst_release(node);
+	return copy;
+}
+
+/* brings node->child[dir] up in its place */
+static pbst_node_t *
+rotate(pbst_t *tree, pbst_node_t *node, int dir)
+{
+	pbst_node_t *c = own(tree, node->child[dir]);
+	if (c == NULL)
+		return node;
+
+	node->child[dir] = c->child[!dir];
+	c->child[!dir] = node;
+	fix_height(node);
+	fix_height(c);
+	return c;
+}
+
+/* node is owned, and its subtrees are balanced */
+static pbst_node_t *
+balance(pbst_t *tree, pbst_node_t *node)
+{
+	int d = height(node->child[1]) - height(node->child[0]);
+
+	fix_height(node);
+	if (d < -1 || d > 1) {
+		int dir = d > 0;
+		pbst_node_t *c = node->child[dir];
+
+		if (height(c->child[!dir]) > height(c->child[dir])) {
+			c = own(tree, c);
+			if (c == NULL)
+				return node;
+			node->child[dir] = rotate(tree, c, !dir);
+		}
+		node = rotate(tree, node, dir);
+	}
+	return node;
+}
+
+static status_t
+insert(pbst_t *tree, pbst_node_t **link, pbst_node_t *new)
+{
+	if (*link == NULL) {
+		*link = new;
+		return OK;
+	}
+
+	pbst_node_t *node = own(tree, *link);
+	if (node == NULL)
+		return ERROR;
+	*link = node;
+
+	int dir = tree->cmp(new->data, node->data) >= 0;
+	status_t ret = insert(tree, &node->child[dir], new);
+	*link = balance(tree, node);
+	return ret;
+}
+
+/* takes the leftmost node out of the subtree */
+static pbst_node_t *
+take_first(pbst_t *tree, pbst_node_t **link)
+{
+	pbst_node_t *node = own(tree, *link);
+	if (node == NULL)
+		return NULL;
+
+	if (node->child[0] == NULL) {
+		*link = node->child[1];
+		node->child[1] = NULL;
+		return node;
+	}
+
+	*link = node;
+	pbst_node_t *ret = take_first(tree, &node->child[0]);
+	*link = balance(tree, node);
+	return ret;
+}
+
+static status_t
+erase(pbst_t *tree, pbst_node_t **link, const void *data)
+{
+	pbst_node_t *node = own(tree, *link);
+	if (node == NULL)
+		return ERROR;
+	*link = node;
+
+	int c = tree->cmp(data, node->data);
+	if (c != 0) {
+		status_t ret = erase(tree, &node->child[c > 0], data);
+		*link = balance(tree, node);
+		return ret;
+	}
+
+	pbst_node_t *next = NULL;
+	if (node->child[0] != NULL && node->child[1] != NULL) {
+		next = take_first(tree, &node->child[1]);
+		if (next == NULL)
+			return ERROR;
+		next->child[0] = node->child[0];
+		next->child[1] = node->child[1];
+		next = balance(tree, next);
+	} else
+		next = node->child[node->child[0] == NULL];
+
+	*link = next;
+	free(node);
+	return OK;
+}
+
+void
+pbst_init(pbst_t *tree, size_t dsize, bst_cmp_t cmp)
+{
+	tree->root = NULL;
+	tree->dsize = dsize;
+	tree->cmp = cmp;
+	tree->size = 0;
+}
+
+/**
+ * Drops the tree's own reference. Roots returned by \c pbst_commit()
+ * stay valid until they are released.
+ */
+void
+pbst_fini(pbst_t *tree)
+{
+	pbst_release(tree->root);
+	tree->root = NULL;
+}
+
+status_t
+pbst_insert(pbst_t *tree, const void *data)
+{
+	pbst_node_t *node = malloc(sizeof(pbst_node_t) + tree->dsize);
+	if (node == NULL)
+		return ERROR;
+
+	node->child[0] = node->child[1] = NULL;
+	node->refs = 1;
+	node->height = 1;
+	memcpy(node->data, data, tree->dsize);
+
+	if (insert(tree, &tree->root, node) != OK) {
+		free(node);
+		return ERROR;
+	}
+	tree->size++;
+	return OK;
+}
+
+/**
+ * Erase a node comparing equal to \c data.
+ * @return
+ *   \c ERROR if there is no such node, or a copy couldn't be made.
+ */
+status_t
+pbst_erase(pbst_t *tree, const void *data)
+{
+	if (pbst_find(tree->root, data, tree->cmp) == NULL)
+		return ERROR;
+	if (erase(tree, &tree->root, data) != OK)
+		return ERROR;
+	tree->size--;
+	return OK;
+}
+
+/**
+ * Freeze the tree as it is now.
+ * @return
+ *   A root that never changes, \c NULL for an empty tree.
+ *   It has to be released with \c pbst_release().
+ */
+pbst_node_t *
+pbst_commit(pbst_t *tree)
+{
+	retain(tree->root);
+	return tree->root;
+}
+
+const void *
+pbst_find(const pbst_node_t *node, const void *data, bst_cmp_t cmp)
+{
+	while (node != NULL) {
+		int c = cmp(data, node->data);
+		if (c == 0)
+			return node->data;
+		node = node->child[c > 0];
+	}
+	return NULL;
+}
+
+/* pushes the way to the leftmost node of the subtree */
+static const void *
+push_first(pbst_iter_t *iter, const pbst_node_t *node)
+{
+	for (; node != NULL; node = node->child[0]) {
+		assert(iter->depth < PBST_MAX_HEIGHT);
+		iter->stack[iter->depth++] = node;
+	}
+	return iter->depth > 0 ? iter->stack[iter->depth - 1]->data : NULL;
+}
+
+/**
+ * Start iterating at the first node not less than \c data.
+ * @return
+ *   Data of that node, \c NULL if there is none.
+ */
+const void *
+pbst_lower_bound(pbst_iter_t *iter, const pbst_node_t *node, const void *data, bst_cmp_t cmp)
+{
+	iter->depth = 0;
+	while (node != NULL) {
+		if (cmp(node->data, data) >= 0) {
+			assert(iter->depth < PBST_MAX_HEIGHT);
+			iter->stack[iter->depth++] = node;
+			node = node->child[0];
+		} else
+			node = node->child[1];
+	}
+	return iter->depth > 0 ? iter->stack[iter->depth - 1]->data : NULL;
+}
+
+const void *
+pbst_begin(pbst_iter_t *iter, const pbst_node_t *node)
+{
+	iter->depth = 0;
+	return push_first(iter, node);
+}
+
+/**
+ * Step to the next node.
+ * @return
+ *   Its data, \c NULL past the last one.
+ */
+const void *
+pbst_next(pbst_iter_t *iter)
+{
+	if (iter->depth == 0)
+		return NULL;
+
+	const pbst_node_t *node = iter->stack[--iter->depth];
+	return push_first(iter, node->child[1]);
+}
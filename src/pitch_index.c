@@ -0,0 +1,153 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * pitch_index.c
+ * the notes of a track by pitch
+ *
+ * each pitch keeps its notes sorted by on_time. a note of that pitch
+ * sounding at s can't have started before s - max_len, max_len being the
+ * longest note the pitch has had (removing notes doesn't shrink it), so a
+ * query only looks at the notes starting within [s - max_len, e).
+ */
+
+#include <stdlib.h> /* realloc */
+#include <memory.h> /* memmove */
+#include "vomid_local.h"
+
+typedef struct entry_t {
+	time_t on_time, off_time;
+	note_t *note;
+} entry_t;
+
+struct vmd_pitch_bucket_t {
+	buf_t entries;
+	time_t max_len;
+};
+
+#define ENTRIES(b) ((entry_t *)(b)->entries.data)
+#define COUNT(b) ((b)->entries.size / sizeof(entry_t))
+
+void
+pitch_index_init(pitch_index_t *idx)
+{
+	idx->beg = 0;
+	idx->size = 0;
+	idx->bucket = NULL;
+	idx->stale = FALSE;
+}
+
+void
+pitch_index_fini(pitch_index_t *idx)
+{
+	for (int i = 0; i < idx->size; i++)
+		buf_fini(&idx->bucket[i].entries);
+	free(idx->bucket);
+	pitch_index_init(idx);
+}
+
+/* makes the buckets cover the pitch */
+static status_t
+cover(pitch_index_t *idx, pitch_t pitch)
+{
+	int beg = idx->size == 0 ? pitch : MIN(idx->beg, pitch);
+	int end = idx->size == 0 ? pitch + 1 : MAX(idx->beg + idx->size, pitch + 1);
+	if (beg == idx->beg && end - beg == idx->size)
+		return OK;
+
+	pitch_bucket_t *bucket = realloc(idx->bucket, (end - beg) * sizeof(*bucket));
+	if (bucket == NULL)
+		return ERROR;
+
+	int shift = idx->size == 0 ? 0 : idx->beg - beg;
+	memmove(bucket + shift, bucket, idx->size * sizeof(*bucket));
+	for (int i = 0; i < end - beg; i++) {
+		if (i < shift || i >= shift + idx->size) {
+			buf_init(&bucket[i].entries);
+			bucket[i].max_len = 0;
+		}
+	}
+	idx->beg = beg;
+	idx->size = end - beg;
+	idx->bucket = bucket;
+	return OK;
+}
+
+/* the first of count entries starting at or after t */
+static size_t
+lower_bound(const entry_t *e, size_t count, time_t t)
+{
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (e[mid].on_time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+status_t
+pitch_index_add(pitch_index_t *idx, note_t *note)
+{
+	if (cover(idx, note->pitch) != OK)
+		return ERROR;
+
+	pitch_bucket_t *b = &idx->bucket[note->pitch - idx->beg];
+	size_t count = COUNT(b);
+	if (buf_grow(&b->entries, sizeof(entry_t)) == NULL)
+		return ERROR;
+
+	/* notes mostly come in order, so look from the end first */
+	entry_t *e = ENTRIES(b);
+	size_t pos = count;
+	if (count > 0 && e[count - 1].on_time > note->on_time) {
+		pos = lower_bound(e, count, note->on_time + 1);
+		memmove(e + pos + 1, e + pos, (count - pos) * sizeof(entry_t));
+	}
+	e[pos].on_time = note->on_time;
+	e[pos].off_time = note->off_time;
+	e[pos].note = note;
+	b->max_len = MAX(b->max_len, note->off_time - note->on_time);
+	return OK;
+}
+
+void
+pitch_index_remove(pitch_index_t *idx, note_t *note)
+{
+	if (note->pitch < idx->beg || note->pitch >= idx->beg + idx->size)
+		return;
+
+	pitch_bucket_t *b = &idx->bucket[note->pitch - idx->beg];
+	entry_t *e = ENTRIES(b);
+	size_t count = COUNT(b);
+	for (size_t i = lower_bound(e, count, note->on_time); i < count && e[i].on_time == note->on_time; i++) {
+		if (e[i].note == note) {
+			memmove(e + i, e + i + 1, (count - i - 1) * sizeof(entry_t));
+			b->entries.size -= sizeof(entry_t);
+			return;
+		}
+	}
+}
+
+size_t
+pitch_index_range(pitch_index_t *idx, time_t s, time_t e, pitch_t p_beg, pitch_t p_end, note_t **out, size_t cap)
+{
+	int beg = MAX(p_beg, idx->beg), end = MIN(p_end, idx->beg + idx->size);
+	size_t n = 0;
+
+	for (int p = beg; p < end; p++) {
+		pitch_bucket_t *b = &idx->bucket[p - idx->beg];
+		entry_t *entry = ENTRIES(b);
+		size_t count = COUNT(b);
+
+		for (size_t i = lower_bound(entry, count, s - b->max_len + 1); i < count && entry[i].on_time < e; i++) {
+			if (entry[i].off_time > s) {
+				if (n < cap)
+					out[n] = entry[i].note;
+				n++;
+			}
+		}
+	}
+	return n;
+}
@@ -2,12 +2,26 @@
  * See LICENSE file for license details.
  */
 
+#include <stdlib.h> /* malloc */
 #include <assert.h>
 #include <string.h>
 #include "vomid_local.h"
 
 #define MAX_EVENTS (FCTRLS + MAX_TRACKS * (2 * NOTES) + CHANNELS * CCTRLS)
 
+/*
+ * events are scheduled on a timing wheel: events less than WHEEL_SIZE ticks
+ * ahead are kept in per-tick lists, the rest wait in a heap. non-empty slots
+ * are marked in a bitmap, with one more word telling which bitmap words are
+ * non-zero. all events of a tick are taken off the wheel at once, as a batch
+ * ordered by priority and then by the order they were scheduled in.
+ */
+#define WHEEL_BITS 12
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WORD_BITS 64
+#define WORDS (WHEEL_SIZE / WORD_BITS) /* must not exceed WORD_BITS */
+
 typedef struct event_t event_t;
 typedef struct ctrl_ctx_t ctrl_ctx_t;
 
@@ -17,9 +31,13 @@ struct event_t {
 	int track;
 	int channel;
 	bst_node_t *node;
+	note_t *(*note)(bst_node_t *); /* of node: in a track or in a channel */
 	ctrl_ctx_t *cctx;
 	void (*move_on)(event_t *, play_ctx_t *);
 	void (*write_event)(small_event_t *, event_t *, play_ctx_t *);
+
+	event_t *next; /* in a wheel slot or in the free list */
+	unsigned seq;
 };
 
 struct ctrl_ctx_t {
@@ -29,15 +47,32 @@ struct ctrl_ctx_t {
 	int value;
 };
 
+typedef struct sched_t {
+	time_t base; /* the wheel holds events in [base, base + WHEEL_SIZE) */
+	event_t *slot[WHEEL_SIZE];
+	uint64_t used[WORDS];
+	uint64_t used_words;
+	int wheel_events;
+
+	event_t *far[MAX_EVENTS]; /* heap */
+	int far_events;
+
+	event_t *batch[MAX_EVENTS];
+	int batch_beg, batch_end;
+	time_t batch_time;
+
+	unsigned seq;
+	stack_t pool;
+	event_t *free;
+} sched_t;
+
 struct play_ctx_t {
 	file_t *file;
 	tevent_clb_t tevent_clb;
 	note_clb_t note_clb;
 	void *arg;
 
-	stack_t ev_pool;
-	event_t *ev_heap[MAX_EVENTS];
-	int events;
+	sched_t *sched; /* too big for the stacks of the player's threads */
 
 	ctrl_ctx_t fctrl[FCTRLS];
 	//ctrl_ctx_t tctrl[MAX_TRACKS][TCTRLS];
@@ -56,21 +91,13 @@ ctrl_ctx_init(ctrl_ctx_t *ctrl_ctx, ctrl_info_t *ctrl_info, int type)
 	ctrl_ctx->value = ctrl_info->default_value;
 }
 
-static int
-heap_cmp(play_ctx_t *ctx, int i, int j)
-{
-	CMP(ctx->ev_heap[i]->time, ctx->ev_heap[j]->time);
-	CMP(ctx->ev_heap[i]->prio, ctx->ev_heap[j]->prio);
-	return 0;
-}
-
 static void
-heap_down(play_ctx_t *ctx, int i)
+far_down(sched_t *s, int i)
 {
 	while (1) {
 		int lesser = i;
 #define CHECK(idx) \
-	if (idx < ctx->events && heap_cmp(ctx, idx, lesser) < 0) \
+	if (idx < s->far_events && s->far[idx]->time < s->far[lesser]->time) \
 		lesser = idx;
 
 		CHECK(i * 2 + 1);
@@ -78,28 +105,170 @@ heap_down(play_ctx_t *ctx, int i)
 #undef CHECK
 		if (lesser == i)
 			break;
-		SWAP(ctx->ev_heap[i], ctx->ev_heap[lesser], event_t *);
+		SWAP(s->far[i], s->far[lesser], event_t *);
 		i = lesser;
 	}
 }
 
 static void
-heap_up(play_ctx_t *ctx, int i)
+far_up(sched_t *s, int i)
 {
 	int parent;
-	while (heap_cmp(ctx, i, parent = (i - 1) / 2) < 0) {
-		SWAP(ctx->ev_heap[i], ctx->ev_heap[parent], event_t *);
+	while (i > 0 && s->far[i]->time < s->far[parent = (i - 1) / 2]->time) {
+		SWAP(s->far[i], s->far[parent], event_t *);
 		i = parent;
 	}
 }
 
 static void
-heap_push(play_ctx_t *ctx, const event_t *ev)
+wheel_insert(sched_t *s, event_t *ev)
 {
-	int idx = ctx->events++;
+	int idx = ev->time & WHEEL_MASK;
 
-	ctx->ev_heap[idx] = stack_push(&ctx->ev_pool, ev);
-	heap_up(ctx, idx);
+	ev->next = s->slot[idx];
+	s->slot[idx] = ev;
+	s->used[idx / WORD_BITS] |= (uint64_t)1 << (idx % WORD_BITS);
+	s->used_words |= (uint64_t)1 << (idx / WORD_BITS);
+	s->wheel_events++;
+}
+
+/* index of the first non-empty slot, starting from base */
+static int
+wheel_first(sched_t *s)
+{
+	int start = s->base & WHEEL_MASK;
+	int word = start / WORD_BITS;
+	uint64_t w = s->used[word] & (~(uint64_t)0 << (start % WORD_BITS));
+
+	if (w == 0) {
+		/* the words after the starting one, then from the beginning */
+		uint64_t after = word + 1 < WORD_BITS ? ~(uint64_t)0 << (word + 1) : 0;
+		uint64_t words = s->used_words & after;
+		if (words == 0)
+			words = s->used_words;
+		assert(words != 0);
+
+		word = lowest_bit(words);
+		w = s->used[word];
+	}
+	return word * WORD_BITS + lowest_bit(w);
+}
+
+/* moves the base, pulling in the far events that come within reach */
+static void
+set_base(sched_t *s, time_t base)
+{
+	s->base = base;
+	while (s->far_events > 0 && s->far[0]->time < base + WHEEL_SIZE) {
+		event_t *ev = s->far[0];
+		s->far[0] = s->far[--s->far_events];
+		far_down(s, 0);
+		wheel_insert(s, ev);
+	}
+}
+
+static void
+batch_insert(sched_t *s, event_t *ev)
+{
+	int i = s->batch_end++;
+
+	while (i > s->batch_beg && (s->batch[i - 1]->prio > ev->prio
+	    || (s->batch[i - 1]->prio == ev->prio && s->batch[i - 1]->seq > ev->seq))) {
+		s->batch[i] = s->batch[i - 1];
+		i--;
+	}
+	s->batch[i] = ev;
+}
+
+static void
+schedule(sched_t *s, event_t *ev)
+{
+	ev->seq = s->seq++;
+	if (s->batch_beg < s->batch_end && ev->time == s->batch_time) {
+		batch_insert(s, ev);
+		return;
+	}
+
+	assert(s->wheel_events + s->far_events == 0 || ev->time >= s->base);
+	if (s->wheel_events + s->far_events == 0 && ev->time < s->base)
+		s->base = ev->time;
+	if (ev->time < s->base + WHEEL_SIZE)
+		wheel_insert(s, ev);
+	else {
+		int idx = s->far_events++;
+		s->far[idx] = ev;
+		far_up(s, idx);
+	}
+}
+
+/* returns the next event to process, or NULL if there are none */
+static event_t *
+next_event(sched_t *s)
+{
+	if (s->batch_beg < s->batch_end)
+		return s->batch[s->batch_beg++];
+
+	if (s->wheel_events == 0) {
+		if (s->far_events == 0)
+			return NULL;
+		set_base(s, s->far[0]->time);
+	}
+
+	int idx = wheel_first(s);
+	set_base(s, s->base + ((idx - s->base) & WHEEL_MASK));
+
+	s->batch_beg = s->batch_end = 0;
+	s->batch_time = s->base;
+	for (event_t *ev = s->slot[idx]; ev != NULL; ev = ev->next) {
+		batch_insert(s, ev);
+		s->wheel_events--;
+	}
+	s->slot[idx] = NULL;
+	s->used[idx / WORD_BITS] &= ~((uint64_t)1 << (idx % WORD_BITS));
+	if (s->used[idx / WORD_BITS] == 0)
+		s->used_words &= ~((uint64_t)1 << (idx / WORD_BITS));
+
+	return s->batch[s->batch_beg++];
+}
+
+static void
+sched_init(sched_t *s)
+{
+	memset(s->slot, 0, sizeof(s->slot));
+	memset(s->used, 0, sizeof(s->used));
+	s->used_words = 0;
+	s->base = 0;
+	s->wheel_events = 0;
+	s->far_events = 0;
+	s->batch_beg = s->batch_end = 0;
+	s->seq = 0;
+	stack_init(&s->pool, sizeof(event_t));
+	s->free = NULL;
+}
+
+static void
+sched_fini(sched_t *s)
+{
+	stack_fini(&s->pool);
+}
+
+static void
+sched_push(sched_t *s, const event_t *ev)
+{
+	event_t *e = s->free;
+	if (e != NULL) {
+		s->free = e->next;
+		*e = *ev;
+	} else
+		e = stack_push(&s->pool, ev);
+	schedule(s, e);
+}
+
+static void
+sched_discard(sched_t *s, event_t *ev)
+{
+	ev->next = s->free;
+	s->free = ev;
 }
 
 static void
@@ -113,7 +282,7 @@ static void
 move_on_note(event_t *ev, play_ctx_t *ctx)
 {
 	ev->node = bst_next(ev->node);
-	ev->time = bst_node_is_end(ev->node) ? -1 : track_note(ev->node)->on_time;
+	ev->time = bst_node_is_end(ev->node) ? -1 : ev->note(ev->node)->on_time;
 }
 
 static void
@@ -122,10 +291,13 @@ move_on_discard(event_t *ev, play_ctx_t *ctx)
 	ev->time = -1;
 }
 
+/* writes the controller changes deferred while the channel was idle */
 static void
 flush_cctrl_cache(play_ctx_t *ctx, int ch)
 {
-	for (int i = 0; i < CCTRLS; i++) {
+	int i;
+
+	FOREACH_BIT(i, ctx->file->channel[ch].used_ctrls, CCTRLS) {
 		ctrl_ctx_t *cctx = &ctx->cctrl[ch][i];
 		if (cctx->write_cache != NULL) {
 			int v = map_value(cctx->write_cache);
@@ -163,7 +335,7 @@ write_ctrl(small_event_t *evb, event_t *ev, play_ctx_t *ctx)
 static void
 write_noteoff(small_event_t *evb, event_t *ev, play_ctx_t *ctx)
 {
-	note_t *note = track_note(ev->node);
+	note_t *note = ev->note(ev->node);
 
 	midi_write_noteoff(evb, note);
 	ctx->channel_notes[note->channel->number]--;
@@ -172,7 +344,7 @@ write_noteoff(small_event_t *evb, event_t *ev, play_ctx_t *ctx)
 static void
 write_noteon(small_event_t *evb, event_t *ev, play_ctx_t *ctx)
 {
-	note_t *note = track_note(ev->node);
+	note_t *note = ev->note(ev->node);
 	int channel = note->channel->number;
 	assert(channel >= 0 && channel < CHANNELS);
 
@@ -188,12 +360,13 @@ write_noteon(small_event_t *evb, event_t *ev, play_ctx_t *ctx)
 	midi_write_noteon(evb, note);
 	ctx->channel_notes[channel]++;
 
-	assert(ev->time < note->off_time); /* the operation below doesn't change ev_heap[0] */
-	heap_push(ctx, &(event_t){
+	assert(ev->time < note->off_time); /* the noteoff doesn't go to the current batch */
+	sched_push(ctx->sched, &(event_t){
 		.time = note->off_time,
 		.prio = -1,
 		.track = ev->track,
 		.node = ev->node,
+		.note = ev->note,
 		.move_on = move_on_discard,
 		.write_event = write_noteoff
 	});
@@ -229,46 +402,75 @@ push_map(play_ctx_t *ctx, event_t *ev, bst_t *bst, time_t time)
 		ev->time = map_time(beg);
 		ev->node = beg;
 		ev->move_on = move_on_map;
-		heap_push(ctx, ev);
+		sched_push(ctx->sched, ev);
 	}
 }
 
+/* what play() plays: the whole file, the file's own controllers or one channel */
+#define PLAY_ALL   (-2)
+#define PLAY_FCTRL (-1)
+
+/* the first note of a track or a channel starting at time or later */
+static void
+push_notes(play_ctx_t *ctx, bst_t *notes, bst_node_t *beg, note_t *(*note)(bst_node_t *), int track)
+{
+	if (beg != bst_end(notes))
+		sched_push(ctx->sched, &(event_t){
+			.prio = 1,
+			.track = track,
+			.time = note(beg)->on_time,
+			.node = beg,
+			.note = note,
+			.move_on = move_on_note,
+			.write_event = write_noteon
+		});
+}
+
 //TODO: tctrls
-status_t
-file_play_(file_t *file, time_t time, tevent_clb_t tevent_clb,
+static status_t
+play(file_t *file, int what, time_t time, tevent_clb_t tevent_clb,
 		dtime_clb_t dtime_clb, note_clb_t note_clb, void *arg, play_ctx_t **pctx)
 {
 	status_t ret = OK;
-	play_ctx_t ctx = {
-		.file = file,
-		.tevent_clb = tevent_clb,
-		.note_clb = note_clb,
-		.arg = arg,
-		.events = 0
-	};
+	/* not zeroed as a whole: only the controllers in use are looked at */
+	play_ctx_t ctx;
 	int i, j;
 
+	ctx.file = file;
+	ctx.tevent_clb = tevent_clb;
+	ctx.note_clb = note_clb;
+	ctx.arg = arg;
+	ctx.sched = malloc(sizeof(sched_t));
+	if (ctx.sched == NULL)
+		return ERROR;
 	if (pctx != NULL)
 		*pctx = &ctx;
-	stack_init(&ctx.ev_pool, sizeof(event_t));
-	for (i = 0; i < CHANNELS; i++)
+	sched_init(ctx.sched);
+	for (i = 0; i < CHANNELS; i++) {
+		ctx.channel_notes[i] = 0;
 		ctx.channel_owner[i] = -1;
+	}
 
 	file_flatten(file);
 
-	for (i = 0; i < FCTRLS; i++) {
-		ctrl_ctx_init(&ctx.fctrl[i], &fctrl_info[i], i);
-		push_map(&ctx, &(event_t){
-			.prio = i,
-			.track = -1,
-			.channel = -1,
-			.cctx = &ctx.fctrl[i],
-			.write_event = write_ctrl
-		}, &file->ctrl[i].bst, time);
+	/* only the controllers that have ever been set need a cursor */
+	if (what == PLAY_ALL || what == PLAY_FCTRL) {
+		FOREACH_BIT(i, file->used_ctrls, FCTRLS) {
+			ctrl_ctx_init(&ctx.fctrl[i], &fctrl_info[i], i);
+			push_map(&ctx, &(event_t){
+				.prio = i,
+				.track = -1,
+				.channel = -1,
+				.cctx = &ctx.fctrl[i],
+				.write_event = write_ctrl
+			}, &file->ctrl[i].bst, time);
+		}
 	}
 
-	for (i = 0; i < CHANNELS; i++)
-		for (j = 0; j < CCTRLS; j++) {
+	for (i = 0; i < CHANNELS; i++) {
+		if (what != PLAY_ALL && what != i)
+			continue;
+		FOREACH_BIT(j, file->channel[i].used_ctrls, CCTRLS) {
 			ctrl_ctx_init(&ctx.cctrl[i][j], &cctrl_info[j], j);
 			push_map(&ctx, &(event_t){
 				.prio = 0,
@@ -276,29 +478,29 @@ file_play_(file_t *file, time_t time, tevent_clb_t tevent_clb,
 				.channel = i,
 				.cctx = &ctx.cctrl[i][j],
 				.write_event = write_ctrl
-			}, &file->channel[i].ctrl[j].bst, time);
+			}, &file->channel[i].ctrl[j]->bst, time);
 		}
+	}
+
+	note_t first = {
+		.on_time = time,
+		.off_time = 0,
+		.midipitch = 0
+	};
+	/* a channel's notes, in the same order as in their tracks */
+	if (what >= 0) {
+		bst_t *notes = &file->channel[what].notes;
+		push_notes(&ctx, notes, bst_lower_bound(notes, &(note_t *){&first}), channel_note, -1);
+	}
 
-	for (i = 0; i < file->tracks; i++) {
+	for (i = 0; i < file->tracks && what == PLAY_ALL; i++) {
 		/* notes */
-		bst_node_t *beg = bst_lower_bound(&file->track[i]->notes, &(note_t){
-			.on_time = time,
-			.off_time = 0,
-			.midipitch = 0
-		});
-		if (beg != bst_end(&file->track[i]->notes))
-			heap_push(&ctx, &(event_t){
-				.prio = 1,
-				.track = i,
-				.time = track_note(beg)->on_time,
-				.node = beg,
-				.move_on = move_on_note,
-				.write_event = write_noteon
-			});
+		bst_t *notes = &file->track[i]->notes;
+		push_notes(&ctx, notes, bst_lower_bound(notes, &first), track_note, i);
 
 		/* end-of-track */
 		/*
-		heap_push(&ctx, &(event_t){
+		sched_push(ctx.sched, &(event_t){
 			.prio = INT_MAX,
 			.track = i,
 			.time = track_note(beg)->on_time,
@@ -309,25 +511,46 @@ file_play_(file_t *file, time_t time, tevent_clb_t tevent_clb,
 		*/
 	}
 
-	while (ctx.events != 0) {
-		if (ctx.ev_heap[0]->time > time) {
-			switch (dtime_clb(ctx.ev_heap[0]->time - time, arg)) {
+	event_t *ev;
+	while ((ev = next_event(ctx.sched)) != NULL) {
+		if (ev->time > time) {
+			switch (dtime_clb(ev->time - time, arg)) {
 			case STOP:
 				ret = STOP;
 				goto stop;
 			}
-			time = ctx.ev_heap[0]->time;
+			time = ev->time;
 		}
-		process_event(ctx.ev_heap[0], &ctx);
-		if (ctx.ev_heap[0]->time < 0)
-			ctx.ev_heap[0] = ctx.ev_heap[--ctx.events];
-		heap_down(&ctx, 0);
+		process_event(ev, &ctx);
+		if (ev->time < 0)
+			sched_discard(ctx.sched, ev);
+		else
+			schedule(ctx.sched, ev);
 	}
 stop:
-	stack_fini(&ctx.ev_pool);
+	sched_fini(ctx.sched);
+	free(ctx.sched);
 	return ret;
 }
 
+status_t
+file_play_(file_t *file, time_t time, tevent_clb_t tevent_clb,
+		dtime_clb_t dtime_clb, note_clb_t note_clb, void *arg, play_ctx_t **pctx)
+{
+	return play(file, PLAY_ALL, time, tevent_clb, dtime_clb, note_clb, arg, pctx);
+}
+
+/*
+ * plays only what goes to one channel, or with channel -1, the file's own
+ * controllers: the events are the same as in the whole file, the track
+ * passed to tevent_clb is -1
+ */
+status_t
+file_play_channel(file_t *file, int channel, tevent_clb_t tevent_clb, dtime_clb_t dtime_clb, void *arg)
+{
+	return play(file, channel < 0 ? PLAY_FCTRL : channel, 0, tevent_clb, dtime_clb, NULL, arg, NULL);
+}
+
 struct file_play_args {
 	file_t *file;
 	time_t time;
@@ -0,0 +1,931 @@
+/* (C)opyright 2009 Anton Novikov
+ * See LICENSE file for license details.
+ *
+ * player.c
+ * realtime playback on a thread of its own
+ *
+ * the render thread plays a snapshot of the file ahead of time and puts the
+ * events, stamped with the absolute time they are due at, into a single-producer
+ * single-consumer ring. the timer thread takes them out, sleeps until each
+ * one is due (sleep_abs(), which is clock_nanosleep() with an absolute time)
+ * and outputs it.
+ *
+ * if the output device can schedule events by itself (vmd_output_at()), the
+ * timer thread hands them over as soon as they are rendered, and the device
+ * delivers them; the lookahead is then how far ahead the device is fed.
+ *
+ * the render thread never touches the file. player_start() and
+ * player_publish() keep the events of the file, stamped with their time, in
+ * a persistent tree (pbst.c), and commit it into a snapshot that never changes
+ * after that and is shared by reference. the file is rendered in parts: the
+ * tempo, the file's other controllers and each channel. a part whose
+ * revision serial (file_serial()) is the same as when it was last rendered
+ * isn't rendered again, and only the events that differ from the last
+ * rendering get into the tree; so publishing after file_commit() costs what
+ * the commit changed, not the whole file.
+ *
+ * the render thread plays the snapshot it holds, and whenever it reaches a
+ * new tick it checks whether a newer one was published; if so it moves over
+ * to it right there: notes that don't sound in the new snapshot at that tick
+ * get a note-off, those that do go on uncut, and the controllers are brought
+ * to their new values.
+ */
+
+#include "config.h"
+#if defined(HAVE_PTHREADS) && defined(HAVE_CLOCK_NANOSLEEP)
+# define _POSIX_C_SOURCE 200112L
+# define PLAYER
+#endif
+
+#include <stdlib.h> /* malloc */
+#include <limits.h> /* UCHAR_MAX */
+#include <memory.h> /* memcpy */
+#ifdef PLAYER
+# include <pthread.h>
+#endif
+#include "vomid_local.h"
+
+#ifdef PLAYER
+
+#define RING_SIZE 4096           /* events */
+#define LOOKAHEAD 0.1            /* default for how far ahead events are rendered, s */
+#define PREROLL 0.005            /* delay before the first event, s */
+#define NAP 0.001                /* polling interval of an idle thread, s */
+#define SLICE 0.01               /* longest sleep without checking for stop, s */
+#define BATCH 64                 /* most events output at once */
+#define LATE 0.001               /* events delivered later than that are counted as late, s */
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+typedef struct slot_t {
+	systime_t due;
+	time_t time;
+	int len;
+	uchar buf[MAX_SMALL_EVENT_LENGTH];
+} slot_t;
+
+/* the parts the file is rendered in */
+#define PART_TEMPO 0
+#define PART_FCTRL 1
+#define PART_CHANNEL(ch) (2 + (ch))
+#define PARTS PART_CHANNEL(CHANNELS)
+
+typedef struct entry_t {
+	time_t time;
+	int part;
+	int seq;       /* among the entries of the part at the same time */
+	int tempo;     /* from here on, for an entry of PART_TEMPO */
+	int len;       /* 0 for an entry that only marks a tempo */
+	uchar buf[MAX_SMALL_EVENT_LENGTH];
+} entry_t;
+
+typedef struct snapshot_t {
+	int refs;
+	unsigned division;
+	pbst_node_t *root; /* of entries, NULL if there are none */
+} snapshot_t;
+
+#define CHASED (128 + 3) /* controllers, program, channel pressure, pitch wheel */
+
+/* what the render thread has sent, or what a snapshot says at some time */
+typedef struct chase_t {
+	uchar on[CHANNELS][128];     /* how many times each note is on */
+	int value[CHANNELS][CHASED]; /* -1 if never set */
+} chase_t;
+
+/* where the render thread is in the snapshot it plays */
+typedef struct cursor_t {
+	snapshot_t *s;         /* NULL until the first switch */
+	int generation;        /* of s */
+	pbst_iter_t iter;
+	const entry_t *e;      /* the next entry, NULL past the last one */
+	int tempo;
+	chase_t sent;
+} cursor_t;
+
+struct vmd_player_t {
+	file_t *file;
+	event_clb_t output;
+	void *arg;
+
+	pthread_t render, timer;
+	bool_t threads;
+	int running;  /* cleared to make the threads stop */
+	int rendered; /* render thread is through the file */
+	int finished; /* timer thread has output everything */
+	bool_t scheduled;      /* events go to output_at() */
+	bool_t stepping;       /* player_step() is under way, nothing waits */
+
+	time_t pos;            /* where the next start() begins */
+	time_t played;         /* time of the last event output */
+	time_t render_pos;
+	systime_t render_time;
+	cursor_t cursor;
+
+	pthread_mutex_t lock;  /* tempo_scale, lookahead, stats and latest */
+	double tempo_scale;
+	systime_t lookahead;
+	player_stats_t stats;
+	systime_t jitter_sum;
+	snapshot_t *latest;    /* last published, NULL if none was */
+	int generation;        /* bumped on every publish */
+
+	/* what the snapshots are made of, only seen by player_publish() */
+	pbst_t events;
+	buf_t part[PARTS];             /* the entries of each part, in order */
+	unsigned long serial[PARTS];   /* file_serial() of each when rendered, 0 to render again */
+
+	unsigned head, tail;   /* written by render and timer thread respectively */
+	unsigned sent;         /* first slot not passed to output_at() yet */
+	slot_t ring[RING_SIZE];
+};
+
+/* sleeps until t, waking up now and then to see if we should stop */
+static bool_t
+wait_till(player_t *p, systime_t t)
+{
+	systime_t cur;
+	while (LOAD(p->running) && (cur = systime()) < t)
+		sleep_abs(MIN(t, cur + SLICE));
+	return LOAD(p->running);
+}
+
+static void
+default_output(unsigned char *buf, size_t len, void *arg)
+{
+	output(buf, len);
+}
+
+/* snapshots */
+
+static int
+entry_cmp(const void *_a, const void *_b)
+{
+	const entry_t *a = _a;
+	const entry_t *b = _b;
+
+	CMP(a->time, b->time);
+	CMP(a->part, b->part);
+	CMP(a->seq, b->seq);
+	return 0;
+}
+
+static bool_t
+same_entry(const entry_t *a, const entry_t *b)
+{
+	return a->tempo == b->tempo && a->len == b->len && !memcmp(a->buf, b->buf, a->len);
+}
+
+typedef struct recorder_t {
+	buf_t entries;
+	int part;
+	time_t time;
+	int seq;
+} recorder_t;
+
+static void
+record(recorder_t *r, const uchar *buf, int len, int tempo)
+{
+	entry_t *e = buf_grow(&r->entries, sizeof(entry_t));
+
+	if (e == NULL)
+		return;
+	e->time = r->time;
+	e->part = r->part;
+	e->seq = r->seq++;
+	e->tempo = tempo;
+	e->len = len;
+	if (len > 0)
+		memcpy(e->buf, buf, len);
+}
+
+static void
+record_event(int track, small_event_t *ev, void *arg)
+{
+	record(arg, ev->buf, ev->len, 0);
+}
+
+static status_t
+record_delay(time_t delay, void *arg)
+{
+	recorder_t *r = arg;
+
+	r->time += delay;
+	r->seq = 0;
+	return r->entries.failed ? STOP : OK;
+}
+
+/* a mark at 0 and at every change of the tempo */
+static void
+record_tempo(recorder_t *r, file_t *file)
+{
+	map_t *tempo = &file->ctrl[FCTRL_TEMPO];
+
+	record(r, NULL, 0, map_get(tempo, 0, NULL));
+	BST_FOREACH(bst_node_t *i, &tempo->bst) {
+		if (map_time(i) > 0) {
+			record_delay(map_time(i) - r->time, r);
+			record(r, NULL, 0, map_value(i));
+		}
+	}
+}
+
+static status_t
+render_part(file_t *file, int part, buf_t *out)
+{
+	recorder_t r = {
+		.part = part,
+		.time = 0,
+		.seq = 0,
+	};
+	status_t ret = OK;
+
+	buf_init(&r.entries);
+	if (part == PART_TEMPO)
+		record_tempo(&r, file);
+	else {
+		int channel = part == PART_FCTRL ? -1 : part - PART_CHANNEL(0);
+		ret = file_play_channel(file, channel, record_event, record_delay, &r);
+	}
+	if (ret != OK || r.entries.failed) {
+		buf_fini(&r.entries);
+		return ERROR;
+	}
+	*out = r.entries;
+	return OK;
+}
+
+/* takes the entries of a part in the tree from old to new, both in order */
+static status_t
+replace_part(pbst_t *tree, const buf_t *old, const buf_t *new)
+{
+	const entry_t *a = (const entry_t *)old->data, *a_end = a + old->size / sizeof(entry_t);
+	const entry_t *b = (const entry_t *)new->data, *b_end = b + new->size / sizeof(entry_t);
+
+	while (a != a_end || b != b_end) {
+		int c = a == a_end ? 1 : b == b_end ? -1 : entry_cmp(a, b);
+
+		if (c == 0 && same_entry(a, b)) {
+			a++;
+			b++;
+			continue;
+		}
+		if (c <= 0 && pbst_erase(tree, a++) != OK)
+			return ERROR;
+		if (c >= 0 && pbst_insert(tree, b++) != OK)
+			return ERROR;
+	}
+	return OK;
+}
+
+/* after a failure, the tree no longer is what the parts say: start over */
+static void
+forget_parts(player_t *p)
+{
+	pbst_fini(&p->events);
+	pbst_init(&p->events, sizeof(entry_t), entry_cmp);
+	for (int i = 0; i < PARTS; i++) {
+		buf_fini(&p->part[i]);
+		p->serial[i] = 0;
+	}
+}
+
+/* brings the parts that changed up to date */
+static status_t
+update_parts(player_t *p)
+{
+	file_t *file = p->file;
+
+	if (file_flatten(file) != OK)
+		return ERROR;
+	for (int i = 0; i < PARTS; i++) {
+		unsigned long serial = file_serial(file, i < PART_CHANNEL(0) ? -1 : i - PART_CHANNEL(0));
+		buf_t entries;
+
+		if (serial != 0 && serial == p->serial[i])
+			continue;
+		if (render_part(file, i, &entries) != OK)
+			return ERROR;
+		if (replace_part(&p->events, &p->part[i], &entries) != OK) {
+			buf_fini(&entries);
+			forget_parts(p);
+			return ERROR;
+		}
+		buf_fini(&p->part[i]);
+		p->part[i] = entries;
+		p->serial[i] = serial;
+	}
+	return OK;
+}
+
+static snapshot_t *
+snapshot_create(player_t *p)
+{
+	if (update_parts(p) != OK)
+		return NULL;
+
+	snapshot_t *s = malloc(sizeof(snapshot_t));
+	if (s == NULL)
+		return NULL;
+	s->refs = 1;
+	s->division = p->file->division;
+	s->root = pbst_commit(&p->events);
+	return s;
+}
+
+static void
+snapshot_release(snapshot_t *s)
+{
+	if (s == NULL || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	pbst_release(s->root);
+	free(s);
+}
+
+static void
+chase_init(chase_t *c)
+{
+	memset(c->on, 0, sizeof(c->on));
+	memset(c->value, -1, sizeof(c->value));
+}
+
+/*
+ * notes that sound and controllers that are set after the event.
+ * FALSE for a note-off of a note that isn't on: playing from the middle,
+ * it belongs to a note that was never sent
+ */
+static bool_t
+chase_event(chase_t *c, const uchar *buf, int len)
+{
+	if (len < 2 || len > 3)
+		return TRUE;
+
+	int ch = buf[0] & 0x0F;
+	uchar *on = &c->on[ch][buf[1] & 0x7F];
+	switch (buf[0] & 0xF0) {
+	case VOICE_NOTEON:
+		if (len < 3)
+			break;
+		if (buf[2] != 0) {
+			*on += *on < UCHAR_MAX;
+			break;
+		}
+		/* fall through */
+	case VOICE_NOTEOFF:
+		if (*on == 0)
+			return FALSE;
+		(*on)--;
+		break;
+	case VOICE_CONTROLLER:
+		/* channel mode messages aren't state */
+		if (len == 3 && buf[1] < 120)
+			c->value[ch][buf[1]] = buf[2];
+		break;
+	case VOICE_PROGRAM:
+		c->value[ch][128] = buf[1];
+		break;
+	case VOICE_CHANNELPRESSURE:
+		c->value[ch][129] = buf[1];
+		break;
+	case VOICE_PITCHWHEEL:
+		if (len == 3)
+			c->value[ch][130] = buf[1] | buf[2] << 7;
+		break;
+	}
+	return TRUE;
+}
+
+static int
+chase_write(uchar *buf, int ch, int key, int value)
+{
+	switch (key) {
+	case 128:
+		buf[0] = VOICE_PROGRAM + ch;
+		buf[1] = value;
+		return 2;
+	case 129:
+		buf[0] = VOICE_CHANNELPRESSURE + ch;
+		buf[1] = value;
+		return 2;
+	case 130:
+		buf[0] = VOICE_PITCHWHEEL + ch;
+		buf[1] = value & 0x7F;
+		buf[2] = value >> 7;
+		return 3;
+	default:
+		buf[0] = VOICE_CONTROLLER + ch;
+		buf[1] = key;
+		buf[2] = value;
+		return 3;
+	}
+}
+
+/* render thread */
+
+static void
+render_event(const uchar *buf, size_t len, void *arg)
+{
+	player_t *p = arg;
+
+	if (len > MAX_SMALL_EVENT_LENGTH)
+		return;
+	if (p->stepping) {
+		p->output((uchar *)buf, len, p->arg);
+		return;
+	}
+	while (p->head - LOAD(p->tail) == RING_SIZE)
+		if (!wait_till(p, systime() + NAP))
+			return;
+
+	slot_t *slot = &p->ring[p->head % RING_SIZE];
+	slot->due = p->render_time;
+	slot->time = p->render_pos;
+	slot->len = len;
+	memcpy(slot->buf, buf, len);
+	STORE(p->head, p->head + 1);
+}
+
+static status_t
+advance(player_t *p, time_t delay, int tempo, unsigned division)
+{
+	if (p->stepping) {
+		p->render_pos += delay;
+		return OK;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	double scale = p->tempo_scale;
+	systime_t lookahead = p->lookahead;
+	pthread_mutex_unlock(&p->lock);
+
+	p->render_pos += delay;
+	p->render_time += time2systime(delay, tempo, division) / scale;
+	return wait_till(p, p->render_time - lookahead) ? OK : STOP;
+}
+
+/*
+ * sends what it takes to go from what the cursor has sent to the state of
+ * the latest snapshot at render_pos, finds the tempo there, and moves over
+ */
+static void
+switch_snapshot(player_t *p, cursor_t *c)
+{
+	chase_t *target = malloc(sizeof(chase_t));
+	chase_t *sent = &c->sent;
+	const entry_t *e;
+	uchar buf[3];
+	int ch, i;
+
+	pthread_mutex_lock(&p->lock);
+	snapshot_t *s = p->latest;
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+	c->generation = p->generation;
+	pthread_mutex_unlock(&p->lock);
+	snapshot_release(c->s);
+	c->s = s;
+
+	if (target != NULL)
+		chase_init(target);
+	for (e = pbst_begin(&c->iter, s->root); e != NULL && e->time < p->render_pos; e = pbst_next(&c->iter)) {
+		if (e->len == 0)
+			c->tempo = e->tempo;
+		else if (target != NULL)
+			chase_event(target, e->buf, e->len);
+	}
+	c->e = e;
+	if (target == NULL)
+		return;
+
+	for (ch = 0; ch < CHANNELS; ch++) {
+		/* notes starting before now in the new snapshot only are left out */
+		for (i = 0; i < 128; i++) {
+			if (target->on[ch][i] != 0)
+				continue;
+			for (; sent->on[ch][i] != 0; sent->on[ch][i]--)
+				render_event((uchar []){VOICE_NOTEON + ch, i, 0}, 3, p);
+		}
+		for (i = 0; i < CHASED; i++) {
+			if (target->value[ch][i] >= 0 && target->value[ch][i] != sent->value[ch][i]) {
+				render_event(buf, chase_write(buf, ch, i, target->value[ch][i]), p);
+				sent->value[ch][i] = target->value[ch][i];
+			}
+		}
+	}
+	free(target);
+}
+
+static void
+render_begin(player_t *p)
+{
+	cursor_t *c = &p->cursor;
+
+	c->s = NULL;
+	c->generation = 0;
+	c->tempo = fctrl_info[FCTRL_TEMPO].default_value;
+	chase_init(&c->sent);
+}
+
+static void
+render_end(player_t *p)
+{
+	snapshot_release(p->cursor.s);
+	p->cursor.s = NULL;
+}
+
+/* plays the snapshots up to until, FALSE once through them or stopped */
+static bool_t
+render(player_t *p, time_t until)
+{
+	cursor_t *c = &p->cursor;
+
+	for (;;) {
+		/* nothing at render_pos has been sent yet, a good time to switch or to pause */
+		if (p->render_pos >= until)
+			return TRUE;
+		if (c->s == NULL || LOAD(p->generation) != c->generation)
+			switch_snapshot(p, c);
+
+		for (; c->e != NULL && c->e->time == p->render_pos; c->e = pbst_next(&c->iter)) {
+			if (c->e->len == 0)
+				c->tempo = c->e->tempo;
+			else if (chase_event(&c->sent, c->e->buf, c->e->len))
+				render_event(c->e->buf, c->e->len, p);
+		}
+		if (c->e == NULL)
+			return FALSE;
+
+		if (advance(p, c->e->time - p->render_pos, c->tempo, c->s->division) != OK)
+			return FALSE;
+	}
+}
+
+static void *
+render_main(void *arg)
+{
+	player_t *p = arg;
+
+	render_begin(p);
+	render(p, MAX_TIME);
+	render_end(p);
+	STORE(p->rendered, 1);
+	return NULL;
+}
+
+/* timer thread */
+
+static void
+account(player_t *p, systime_t lateness, unsigned n)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stats.events += n;
+	if (lateness > LATE)
+		p->stats.late += n;
+	if (lateness < 0)
+		lateness = -lateness;
+	p->jitter_sum += lateness * n;
+	p->stats.jitter_max = MAX(p->stats.jitter_max, lateness);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* hands the rendered events over to the device, they stay in the ring until due */
+static void
+schedule(player_t *p, unsigned head)
+{
+	for (; p->sent != head; p->sent++) {
+		slot_t *slot = &p->ring[p->sent % RING_SIZE];
+		account(p, MAX(systime() - slot->due, 0), 1);
+		output_at(slot->buf, slot->len, slot->due);
+	}
+	flush_output();
+}
+
+/* outputs the events due at the same time as the tail one, returns how many */
+static unsigned
+deliver(player_t *p, unsigned head)
+{
+	const uchar *evs[BATCH];
+	size_t sizes[BATCH];
+	systime_t due = p->ring[p->tail % RING_SIZE].due;
+	systime_t lateness = systime() - due;
+	unsigned n = 0;
+
+	do {
+		slot_t *slot = &p->ring[(p->tail + n) % RING_SIZE];
+		if (p->output == default_output) {
+			evs[n] = slot->buf;
+			sizes[n] = slot->len;
+		} else
+			p->output(slot->buf, slot->len, p->arg);
+		n++;
+	} while (n < BATCH && p->tail + n != head && p->ring[(p->tail + n) % RING_SIZE].due == due);
+
+	if (p->output == default_output) {
+		output_batch(evs, sizes, n);
+		flush_output();
+	}
+	account(p, lateness, n);
+	return n;
+}
+
+static void *
+timer_main(void *arg)
+{
+	player_t *p = arg;
+
+	while (LOAD(p->running)) {
+		unsigned head = LOAD(p->head);
+		if (p->scheduled && p->sent != head)
+			schedule(p, head);
+
+		if (p->tail == head) {
+			if (LOAD(p->rendered) && p->tail == LOAD(p->head))
+				break;
+			wait_till(p, systime() + NAP);
+			continue;
+		}
+
+		slot_t *slot = &p->ring[p->tail % RING_SIZE];
+		if (!wait_till(p, p->scheduled ? MIN(slot->due, systime() + NAP) : slot->due))
+			break;
+		if (systime() < slot->due)
+			continue;
+
+		unsigned n = p->scheduled ? 1 : deliver(p, head);
+		STORE(p->played, p->ring[(p->tail + n - 1) % RING_SIZE].time);
+		STORE(p->tail, p->tail + n);
+	}
+	STORE(p->finished, 1);
+	return NULL;
+}
+
+/* controls */
+
+player_t *
+player_create(file_t *file, event_clb_t clb, void *arg)
+{
+	player_t *p = malloc(sizeof(player_t));
+	if (p == NULL)
+		return NULL;
+
+	p->file = file;
+	p->output = clb != NULL ? clb : default_output;
+	p->arg = arg;
+	p->threads = FALSE;
+	p->stepping = FALSE;
+	p->running = 0;
+	p->pos = p->played = 0;
+	p->tempo_scale = 1;
+	p->lookahead = LOOKAHEAD;
+	p->latest = NULL;
+	p->generation = 0;
+	pbst_init(&p->events, sizeof(entry_t), entry_cmp);
+	for (int i = 0; i < PARTS; i++) {
+		buf_init(&p->part[i]);
+		p->serial[i] = 0;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	return p;
+}
+
+void
+player_destroy(player_t *p)
+{
+	player_stop(p);
+	snapshot_release(p->latest);
+	pbst_fini(&p->events);
+	for (int i = 0; i < PARTS; i++)
+		buf_fini(&p->part[i]);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+/*
+ * called on the thread that edits the file, when it's consistent;
+ * the render thread moves over to what's published at the next tick
+ */
+status_t
+player_publish(player_t *p)
+{
+	snapshot_t *s = snapshot_create(p);
+	if (s == NULL)
+		return ERROR;
+
+	pthread_mutex_lock(&p->lock);
+	snapshot_t *old = p->latest;
+	p->latest = s;
+	STORE(p->generation, p->generation + 1);
+	pthread_mutex_unlock(&p->lock);
+	snapshot_release(old);
+	return OK;
+}
+
+status_t
+player_start(player_t *p)
+{
+	if (player_playing(p))
+		return OK;
+	player_stop(p);
+	/* the file as it is now, the threads never look at it */
+	if (player_publish(p) != OK)
+		return ERROR;
+
+	p->head = p->tail = p->sent = 0;
+	p->rendered = p->finished = 0;
+	p->played = p->render_pos = p->pos;
+	p->render_time = systime() + PREROLL;
+	p->scheduled = p->output == default_output && can_output_at();
+	memset(&p->stats, 0, sizeof(p->stats));
+	p->jitter_sum = 0;
+
+	STORE(p->running, 1);
+	if (pthread_create(&p->render, NULL, render_main, p) != 0) {
+		p->running = 0;
+		return ERROR;
+	}
+	if (pthread_create(&p->timer, NULL, timer_main, p) != 0) {
+		STORE(p->running, 0);
+		pthread_join(p->render, NULL);
+		return ERROR;
+	}
+	p->threads = TRUE;
+	return OK;
+}
+
+void
+player_stop(player_t *p)
+{
+	if (p->stepping) {
+		render_end(p);
+		p->stepping = FALSE;
+	}
+	if (!p->threads)
+		return;
+
+	bool_t interrupted = !LOAD(p->finished);
+	STORE(p->running, 0);
+	pthread_join(p->render, NULL);
+	pthread_join(p->timer, NULL);
+	p->threads = FALSE;
+	p->pos = p->played;
+
+	if (interrupted) {
+		if (p->scheduled)
+			drop_output();
+		if (p->output == default_output) {
+			notes_off();
+		} else {
+			for (int i = 0; i < CHANNELS; i++)
+				p->output((uchar []){VOICE_CONTROLLER + i, CTRL_NOTES_OFF, 0}, 3, p->arg);
+		}
+	}
+}
+
+bool_t
+player_playing(player_t *p)
+{
+	return p->threads && !LOAD(p->finished);
+}
+
+/*
+ * plays on from where the player is up to until, on the calling thread and
+ * without waiting: the events go out as they are rendered. STOP once through
+ * the file. the first step publishes the file, as player_start() does
+ */
+status_t
+player_step(player_t *p, time_t until)
+{
+	if (player_playing(p))
+		return ERROR;
+	if (!p->stepping) {
+		player_stop(p);
+		if (player_publish(p) != OK)
+			return ERROR;
+		p->render_pos = p->pos;
+		render_begin(p);
+		p->stepping = TRUE;
+	}
+
+	bool_t more = render(p, until);
+	p->pos = p->render_pos;
+	if (!more)
+		player_stop(p);
+	return more ? OK : STOP;
+}
+
+status_t
+player_seek(player_t *p, time_t time)
+{
+	bool_t playing = player_playing(p);
+
+	player_stop(p);
+	p->pos = time;
+	return playing ? player_start(p) : OK;
+}
+
+time_t
+player_position(player_t *p)
+{
+	return p->threads ? LOAD(p->played) : p->pos;
+}
+
+void
+player_set_tempo_scale(player_t *p, double scale)
+{
+	if (scale <= 0)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->tempo_scale = scale;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+player_set_lookahead(player_t *p, systime_t lookahead)
+{
+	pthread_mutex_lock(&p->lock);
+	p->lookahead = MAX(lookahead, 0);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+player_stats(player_t *p, player_stats_t *stats)
+{
+	pthread_mutex_lock(&p->lock);
+	*stats = p->stats;
+	stats->jitter_avg = stats->events ? p->jitter_sum / stats->events : 0;
+	pthread_mutex_unlock(&p->lock);
+}
+
+#else /* PLAYER */
+
+/* no threads or no clock to sleep on: there is no player */
+
+player_t *
+player_create(file_t *file, event_clb_t clb, void *arg)
+{
+	return NULL;
+}
+
+void
+player_destroy(player_t *p)
+{
+}
+
+status_t
+player_publish(player_t *p)
+{
+	return ERROR;
+}
+
+status_t
+player_start(player_t *p)
+{
+	return ERROR;
+}
+
+status_t
+player_step(player_t *p, time_t until)
+{
+	return ERROR;
+}
+
+void
+player_stop(player_t *p)
+{
+}
+
+bool_t
+player_playing(player_t *p)
+{
+	return FALSE;
+}
+
+status_t
+player_seek(player_t *p, time_t time)
+{
+	return ERROR;
+}
+
+time_t
+player_position(player_t *p)
+{
+	return 0;
+}
+
+void
+player_set_tempo_scale(player_t *p, double scale)
+{
+}
+
+void
+player_set_lookahead(player_t *p, systime_t lookahead)
+{
+}
+
+void
+player_stats(player_t *p, player_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif /* PLAYER */
@@ -63,32 +63,127 @@ track_for_range(track_t *track, time_t s, time_t e, note_callback_t clb, void *a
 	return range(&track->notes, s, e, clb, arg);
 }
 
-struct range_arg {
-	note_t *list;
-	pitch_t p_beg, p_end;
-};
+note_t *
+track_range(track_t *track, time_t s, time_t e, pitch_t p_beg, pitch_t p_end)
+{
+	track_range_iter_t it;
+	note_t *list = NULL, *note;
 
-static void *
-range_clb(note_t *note, void *_arg)
+	track_range_begin(&it, track, s, e, p_beg, p_end);
+	while ((note = track_range_next(&it)) != NULL) {
+		note->next = list;
+		list = note;
+	}
+	return list;
+}
+
+/*
+ * the same walk as range_(), but the subtrees still to visit are kept on
+ * it->stack instead of the call stack. an AVL tree is never deeper than
+ * 1.44 * log2(notes), and the stack holds at most depth + 1 nodes.
+ */
+void
+track_range_begin(track_range_iter_t *it, track_t *track, time_t s, time_t e, pitch_t p_beg, pitch_t p_end)
 {
-	struct range_arg *arg = _arg;
-	if (arg->p_beg <= note->pitch && note->pitch < arg->p_end) {
-		note->next = arg->list;
-		arg->list = note;
+	bst_node_t *root = bst_root(&track->notes);
+
+	it->s = s;
+	it->e = e;
+	it->p_beg = p_beg;
+	it->p_end = p_end;
+	it->depth = 0;
+	if (root != NULL)
+		it->stack[it->depth++] = root;
+}
+
+note_t *
+track_range_next(track_range_iter_t *it)
+{
+	while (it->depth > 0) {
+		bst_node_t *node = it->stack[--it->depth];
+		bst_node_t *l = node->child[0], *r = node->child[1];
+		note_t *n = note(node);
+
+		if (r != NULL && max_off(r) > it->s && n->on_time < it->e)
+			it->stack[it->depth++] = r;
+		if (l != NULL && max_off(l) > it->s)
+			it->stack[it->depth++] = l;
+		if (it->s < n->off_time && n->on_time < it->e &&
+			it->p_beg <= n->pitch && n->pitch < it->p_end)
+				return n;
 	}
 	return NULL;
 }
 
-note_t *
-track_range(track_t *track, time_t s, time_t e, pitch_t p_beg, pitch_t p_end)
+size_t
+track_range_into(track_t *track, time_t s, time_t e, pitch_t p_beg, pitch_t p_end, note_t **out, size_t cap)
 {
-	struct range_arg arg = {
-		.list = NULL,
-		.p_beg = p_beg,
-		.p_end = p_end
-	};
-	track_for_range(track, s, e, range_clb, &arg);
-	return arg.list;
+	track_range_iter_t it;
+	note_t *note;
+	size_t n = 0;
+
+	if (track->pitch_index != NULL && !track->pitch_index->stale)
+		return pitch_index_range(track->pitch_index, s, e, p_beg, p_end, out, cap);
+
+	track_range_begin(&it, track, s, e, p_beg, p_end);
+	while ((note = track_range_next(&it)) != NULL) {
+		if (n < cap)
+			out[n] = note;
+		n++;
+	}
+	return n;
+}
+
+static void
+rebuild_pitch_index(track_t *track)
+{
+	pitch_index_t *idx = track->pitch_index;
+
+	pitch_index_fini(idx);
+	BST_FOREACH (bst_node_t *i, &track->notes) {
+		if (pitch_index_add(idx, track_note(i)) != OK) {
+			idx->stale = TRUE;
+			break;
+		}
+	}
+}
+
+status_t
+track_index_pitches(track_t *track, bool_t on)
+{
+	if (!on) {
+		if (track->pitch_index != NULL) {
+			pitch_index_fini(track->pitch_index);
+			free(track->pitch_index);
+			track->pitch_index = NULL;
+		}
+		return OK;
+	}
+
+	if (track->pitch_index == NULL) {
+		track->pitch_index = malloc(sizeof(pitch_index_t));
+		if (track->pitch_index == NULL)
+			return ERROR;
+		pitch_index_init(track->pitch_index);
+		rebuild_pitch_index(track);
+	}
+	return track->pitch_index->stale ? ERROR : OK;
+}
+
+void
+track_note_added(track_t *track, note_t *note)
+{
+	pitch_index_t *idx = track->pitch_index;
+	if (idx != NULL && !idx->stale && pitch_index_add(idx, note) != OK)
+		idx->stale = TRUE;
+}
+
+void
+track_note_removed(track_t *track, note_t *note)
+{
+	pitch_index_t *idx = track->pitch_index;
+	if (idx != NULL && !idx->stale)
+		pitch_index_remove(idx, note);
 }
 
 track_t *
@@ -112,12 +207,15 @@ track_init(track_t *track, file_t *file, chanmask_t chanmask)
 	track->notesystem = notesystem_midistd();
 	track->chanmask = chanmask;
 	track->temp_channels = NULL;
+	track->temp_notes = 0;
+	track->pitch_index = NULL;
 	memset(track->channel_usage, 0, sizeof(track->channel_usage));
 }
 
 void
 track_fini(track_t *track)
 {
+	track_index_pitches(track, FALSE);
 	bst_fini(&track->notes);
 	for (channel_t *i = track->temp_channels, *next; i != NULL; i = next) {
 		next = i->next;
@@ -175,7 +273,7 @@ track_insert(track_t *track, time_t beg, time_t end, pitch_t pitch)
 
 	note_t *note = insert_note(&n);
 	note_reset_pitch(note, pitch);
-	map_set_range(&note->channel->ctrl[CCTRL_PROGRAM], beg, end, track_get_ctrl(track, CCTRL_PROGRAM));
+	map_set_range(channel_ctrl(note->channel, CCTRL_PROGRAM), beg, end, track_get_ctrl(track, CCTRL_PROGRAM));
 	return note;
 }
 
@@ -185,43 +283,109 @@ track_note(bst_node_t *node)
         return (note_t *)node->data;
 }
 
-static bool_t
-compatible(note_t *n1, note_t *n2)
+/*
+ * a note may move to a channel if every note it overlaps there is of the
+ * same track, of another midipitch, and sees the same controllers during
+ * the overlap. the overlaps are collected, merged and compared once, and
+ * only the controllers either channel has ever used are compared.
+ */
+
+#define OVERLAPS 64
+
+typedef struct overlap_t {
+	time_t beg, end;
+} overlap_t;
+
+struct can_move_arg {
+	note_t *note;
+	channel_t *channel;
+	uint64_t used[BITMAP_WORDS(CCTRLS)];
+	int overlaps;
+	overlap_t overlap[OVERLAPS];
+};
+
+static int
+overlap_cmp(const void *a, const void *b)
 {
-	channel_t *c1 = n1->channel, *c2 = n2->channel;
-	time_t s = MAX(n1->on_time, n2->on_time);
-	time_t e = MIN(n1->off_time, n2->off_time);
+	const overlap_t *o1 = a, *o2 = b;
+	CMP(o1->beg, o2->beg);
+	return 0;
+}
 
-	if (n1->track != n2->track || n1->midipitch == n2->midipitch)
-		return FALSE;
-	for (int i = 0; i < CCTRLS; i++)
-		if (!map_eq(&c1->ctrl[i], &c2->ctrl[i], s, e))
+static bool_t
+ctrls_eq(struct can_move_arg *arg, time_t beg, time_t end)
+{
+	int i;
+	FOREACH_BIT(i, arg->used, CCTRLS) {
+		if (!map_eq(arg->note->channel->ctrl[i], arg->channel->ctrl[i], beg, end))
 			return FALSE;
-
+	}
 	return TRUE;
 }
 
+/* compares the controllers over the overlaps collected so far */
+static bool_t
+overlaps_ok(struct can_move_arg *arg)
+{
+	overlap_t *o = arg->overlap;
+	int n = arg->overlaps;
+
+	arg->overlaps = 0;
+	if (n == 0)
+		return TRUE;
+
+	qsort(o, n, sizeof(*o), overlap_cmp);
+	time_t beg = o[0].beg, end = o[0].end;
+	for (int i = 1; i < n; i++) {
+		if (o[i].beg > end) {
+			if (!ctrls_eq(arg, beg, end))
+				return FALSE;
+			beg = o[i].beg;
+		}
+		end = MAX(end, o[i].end);
+	}
+	return ctrls_eq(arg, beg, end);
+}
+
 static void *
-can_move_clb(note_t *note, void *_note_to_move)
+can_move_clb(note_t *note, void *_arg)
 {
-	return compatible(note, _note_to_move) ? NULL : note;
+	struct can_move_arg *arg = _arg;
+	note_t *moved = arg->note;
+
+	if (note->track != moved->track || note->midipitch == moved->midipitch)
+		return note;
+	if (arg->overlaps == OVERLAPS && !overlaps_ok(arg))
+		return note;
+
+	overlap_t *o = &arg->overlap[arg->overlaps++];
+	o->beg = MAX(note->on_time, moved->on_time);
+	o->end = MIN(note->off_time, moved->off_time);
+	return NULL;
 }
 
 static bool_t
 can_move(note_t *note, channel_t *channel)
 {
-	return channel_range(channel, note->on_time, note->off_time, can_move_clb, note) == NULL;
+	struct can_move_arg arg;
+
+	arg.note = note;
+	arg.channel = channel;
+	arg.overlaps = 0;
+	for (int i = 0; i < BITMAP_WORDS(CCTRLS); i++)
+		arg.used[i] = note->channel->used_ctrls[i] | channel->used_ctrls[i];
+
+	return channel_range(channel, note->on_time, note->off_time, can_move_clb, &arg) == NULL &&
+		overlaps_ok(&arg);
 }
 
 static void
 move(note_t *note, channel_t *channel)
 {
 	note_set_channel(note, channel);
-	for (int i = 0; i < CCTRLS; i++)
-		map_copy(&note->channel->ctrl[i], note->on_time, note->off_time, &channel->ctrl[i], note->on_time);
+	channel_copy_ctrls(note->channel, note->on_time, note->off_time, channel, note->on_time);
 }
 
-//TODO: optimize
 static void
 channel_join(channel_t *channel, channel_t *temp)
 {
@@ -236,17 +400,11 @@ channel_join(channel_t *channel, channel_t *temp)
 	}
 }
 
+/* channels used less by other tracks and more by this one come first */
 static int
-chan_cmp(track_t *track, int c1, int c2)
+chan_cmp(track_t *track, const int *others, int c1, int c2)
 {
-	int o1 = 0, o2 = 0;
-	for (int i = 0; i < track->file->tracks; i++)
-		if (track->file->track[i] != track) {
-			o1 += track->file->track[i]->channel_usage[c1];
-			o2 += track->file->track[i]->channel_usage[c2];
-		}
-
-	CMP(o1, o2);
+	CMP(others[c1], others[c2]);
 	CMP(-track->channel_usage[c1], -track->channel_usage[c2]);
 
 	return 0;
@@ -261,8 +419,8 @@ note_ok_clb(note_t *note, void *note1)
 static bool_t
 note_ok(note_t *n)
 {
-        note_t *notes = track_range(n->track, n->on_time, n->off_time, n->pitch, n->pitch + 1);
-	return notes == n && n->next == NULL;
+	note_t *notes[2];
+	return track_range_into(n->track, n->on_time, n->off_time, n->pitch, n->pitch + 1, notes, 2) == 1 && notes[0] == n;
 }
 
 //TODO: what about killing empty temp channels?
@@ -270,14 +428,24 @@ status_t
 track_flatten(track_t *track)
 {
 	int channel[CHANNELS], channels = 0;
+	int others[CHANNELS] = {0};
 	int i;
 
+	/* only notes isolated since the last flatten are in temp channels */
+	if (track->temp_notes == 0)
+		return OK;
+
+	for (int t = 0; t < track->file->tracks; t++)
+		if (track->file->track[t] != track)
+			for (i = 0; i < CHANNELS; i++)
+				others[i] += track->file->track[t]->channel_usage[i];
+
 	for (i = 0; i < CHANNELS; i++)
 		if ((track->chanmask & (1 << i)) != 0)
 			channel[channels++] = i;
 	/* gnome sort :) */
 	for (i = 0; i < channels; )
-		if (i == 0 || chan_cmp(track, channel[i - 1], channel[i]) <= 0)
+		if (i == 0 || chan_cmp(track, others, channel[i - 1], channel[i]) <= 0)
 			i++;
 		else {
 			SWAP(channel[i - 1], channel[i], int);
@@ -285,6 +453,8 @@ track_flatten(track_t *track)
 		}
 
 	for (channel_t *tc = track->temp_channels; tc != NULL; tc = tc->next) {
+		if (bst_empty(&tc->notes))
+			continue;
 		BST_FOREACH (bst_node_t *i, &tc->notes) {
 			if (!note_ok(channel_note(i)))
 				return ERROR;
@@ -306,6 +476,17 @@ track_commit(track_t *track, track_rev_t *rev)
 	memcpy(rev->primary_ctrl_value, track->primary_ctrl_value, sizeof(rev->primary_ctrl_value));
 }
 
+/*
+ * has the track changed since rev, the revision it was last committed or updated to?
+ * notes in temp channels aren't in any revision, whatever their track says
+ */
+bool_t
+track_dirty(track_t *track, track_rev_t *rev)
+{
+	return track->temp_notes != 0 || bst_dirty(&track->notes) || track->name != rev->name ||
+		memcmp(track->primary_ctrl_value, rev->primary_ctrl_value, sizeof(rev->primary_ctrl_value)) != 0;
+}
+
 void
 track_update(track_t *track, track_rev_t *rev)
 {
@@ -314,10 +495,23 @@ track_update(track_t *track, track_rev_t *rev)
 			erase_note(channel_note(bst_root(&i->notes)));
 
 	bst_update(&track->notes, rev->notes);
+	if (track->pitch_index != NULL)
+		rebuild_pitch_index(track);
 	track->name = rev->name;
 	memcpy(track->primary_ctrl_value, rev->primary_ctrl_value, sizeof(track->primary_ctrl_value));
 }
 
+void
+track_prune(track_t *track, track_rev_t **keep, int n)
+{
+	bst_rev_t **revs = malloc(n * sizeof(*revs));
+
+	for (int k = 0; k < n; k++)
+		revs[k] = keep[k]->notes;
+	bst_prune(&track->notes, revs, n);
+	free(revs);
+}
+
 int
 track_get_ctrl(track_t *track, int ctrl){
 	if (track->primary_ctrl_value[ctrl] < 0) {
@@ -325,7 +519,7 @@ track_get_ctrl(track_t *track, int ctrl){
 			track->primary_ctrl_value[ctrl] = cctrl_info[ctrl].default_value;
 		else {
 			note_t *n = track_note(bst_root(&track->notes));
-			track->primary_ctrl_value[ctrl] = map_get(&n->channel->ctrl[ctrl], n->on_time, NULL);
+			track->primary_ctrl_value[ctrl] = map_get(n->channel->ctrl[ctrl], n->on_time, NULL);
 		}
 	}
 	return track->primary_ctrl_value[ctrl];
@@ -339,7 +533,7 @@ track_set_ctrl(track_t *track, int ctrl, int value){
 	BST_FOREACH (bst_node_t *i, &track->notes) {
 		note_t *n = track_note(i);
 		//no need to isolate them, we operate on the whole track
-		map_set_range(&n->channel->ctrl[ctrl], n->on_time, n->off_time, value);
+		map_set_range(channel_ctrl(n->channel, ctrl), n->on_time, n->off_time, value);
 	}
 }
 
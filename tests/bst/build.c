@@ -0,0 +1,24 @@
+#include "common.h"
+
+void
+test_build()
+{
+	qsort(idata, idatalen, sizeof(int), int_cmp);
+
+	bst_build_sorted(tree, idata, idatalen, sizeof(int));
+	verify_tree(tree);
+	assert_eq(bst_begin(tree), bst_end(tree), idata, idata + idatalen);
+
+	/* appending in batches of different sizes */
+	bst_clear(tree);
+	for (int i = 0; i < idatalen; ) {
+		int n = rand() % 64 == 0 ? rand() % (idatalen + 1) : rand() % 8;
+		n = MIN(n, idatalen - i);
+		bst_node_t *first = bst_append_sorted(tree, idata + i, n, sizeof(int));
+		if (n > 0)
+			ASSERT_EQ_INT(*(int *)first->data, idata[i]);
+		verify_tree(tree);
+		i += n;
+	}
+	assert_eq(bst_begin(tree), bst_end(tree), idata, idata + idatalen);
+}
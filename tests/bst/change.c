@@ -0,0 +1,39 @@
+#include "common.h"
+
+static void
+change(int delta)
+{
+	BST_FOREACH (bst_node_t *i, tree) {
+		elem_t e = *(elem_t *)i->data;
+		e.v += delta;
+		bst_change(tree, i, &e);
+	}
+	verify_tree(tree);
+}
+
+void
+test_change()
+{
+	/* order is kept, nodes stay in place */
+	change(1);
+	change(-1);
+
+	/* order is broken, nodes get relocated */
+	bst_node_t **nodes = malloc(idatalen * sizeof(bst_node_t *));
+	int n = 0;
+	BST_FOREACH (bst_node_t *i, tree)
+		nodes[n++] = i;
+	ASSERT_EQ_INT(n, idatalen);
+
+	for (int i = 0; i < n; i++) {
+		idata[i] = rand() % (idatalen + 1);
+		bst_change(tree, nodes[i], &idata[i]);
+		if (i % 256 == 0)
+			verify_tree(tree);
+	}
+	free(nodes);
+	verify_tree(tree);
+
+	qsort(idata, idatalen, sizeof(int), int_cmp);
+	assert_eq(bst_begin(tree), bst_end(tree), idata, idata + idatalen);
+}
@@ -0,0 +1,84 @@
+#include "common.h"
+#include <string.h> /* memcpy */
+
+/* checks balancing, returns height of subtree */
+static int
+verify_pbst(const pbst_node_t *node, int *size)
+{
+	if (node == NULL)
+		return 0;
+
+	int s[2] = {0, 0};
+	int h0 = verify_pbst(node->child[0], &s[0]);
+	int h1 = verify_pbst(node->child[1], &s[1]);
+
+	ASSERT(node->refs > 0);
+	ASSERT(-1 <= h0 - h1 && h0 - h1 <= 1);
+	ASSERT_EQ_INT(MAX(h0, h1) + 1, node->height);
+	*size += s[0] + s[1] + 1;
+	return node->height;
+}
+
+static void
+assert_pbst_eq(const pbst_node_t *root, int *s, int *e)
+{
+	pbst_iter_t iter;
+	const int *i;
+
+	for (i = pbst_begin(&iter, root); i != NULL && s != e; i = pbst_next(&iter), s++)
+		ASSERT_EQ_INT(*i, *s);
+	ASSERT(i == NULL);
+	ASSERT(s == e);
+}
+
+void
+test_persistent()
+{
+	pbst_t ptree;
+	int n = idatalen / 2, size = 0;
+
+	pbst_init(&ptree, sizeof(int), int_cmp);
+	for (int i = 0; i < idatalen; i++)
+		ASSERT(pbst_insert(&ptree, &idata[i]) == OK);
+	pbst_node_t *all = pbst_commit(&ptree);
+
+	for (int i = n; i < idatalen; i++)
+		ASSERT(pbst_erase(&ptree, &idata[i]) == OK);
+	pbst_node_t *half = pbst_commit(&ptree);
+	verify_pbst(ptree.root, &size);
+	ASSERT_EQ_INT(size, n);
+	ASSERT_EQ_INT(ptree.size, n);
+
+	/* edits after the commits don't show through */
+	for (int i = 0; i < n; i++)
+		ASSERT(pbst_erase(&ptree, &idata[i]) == OK);
+	ASSERT(ptree.root == NULL);
+	for (int i = n; i < idatalen; i++)
+		ASSERT(pbst_insert(&ptree, &idata[i]) == OK);
+
+	int *sorted = malloc(idatalen * sizeof(int));
+	memcpy(sorted, idata, idatalen * sizeof(int));
+	qsort(sorted, idatalen, sizeof(int), int_cmp);
+	assert_pbst_eq(all, sorted, sorted + idatalen);
+
+	memcpy(sorted, idata, n * sizeof(int));
+	qsort(sorted, n, sizeof(int), int_cmp);
+	assert_pbst_eq(half, sorted, sorted + n);
+	for (int i = 0; i < n; i++) {
+		pbst_iter_t iter;
+		ASSERT(pbst_find(half, &idata[i], int_cmp) != NULL);
+		ASSERT_EQ_INT(*(const int *)pbst_lower_bound(&iter, half, &idata[i], int_cmp), idata[i]);
+	}
+
+	memcpy(sorted, idata + n, (idatalen - n) * sizeof(int));
+	qsort(sorted, idatalen - n, sizeof(int), int_cmp);
+	assert_pbst_eq(ptree.root, sorted, sorted + idatalen - n);
+
+	pbst_release(all);
+	pbst_release(half);
+	size = 0;
+	verify_pbst(ptree.root, &size);
+	ASSERT_EQ_INT(size, idatalen - n);
+	pbst_fini(&ptree);
+	free(sorted);
+}
@@ -0,0 +1,87 @@
+#include <memory.h> /* memcpy */
+#include "common.h"
+
+#define REVS 30
+#define KEPT 5
+#define UPDATES 20
+
+static int *data;
+
+/* the tree must hold idata[s, e) */
+static void
+check(int s, int e)
+{
+	memcpy(data, idata + s, (e - s) * sizeof(int));
+	qsort(data, e - s, sizeof(int), int_cmp);
+	verify_tree(tree);
+	assert_eq(bst_begin(tree), bst_end(tree), data, data + (e - s));
+}
+
+static void
+fill(int s, int e)
+{
+	bst_clear(tree);
+	for (int j = s; j != e; j++)
+		bst_insert(tree, &idata[j]);
+}
+
+void
+test_prune()
+{
+	if (idatalen == 0)
+		return;
+
+	int i, k;
+	struct {
+		bst_rev_t *rev;
+		int s;
+		int e;
+	} revs[REVS];
+	bst_rev_t *keep[KEPT];
+	int kept[KEPT + 1];
+
+	/* a branching history, long enough for skip pointers */
+	for (i = 0; i < REVS; i++) {
+		if (i > 0)
+			bst_update(tree, revs[rand() % i].rev);
+
+		revs[i].s = rand() % idatalen;
+		revs[i].e = rand() % idatalen;
+		if (revs[i].s > revs[i].e)
+			SWAP(revs[i].s, revs[i].e, int);
+
+		fill(revs[i].s, revs[i].e);
+		revs[i].rev = bst_commit(tree);
+	}
+
+	for (k = 0; k < KEPT; k++) {
+		kept[k] = rand() % (REVS - 1);
+		keep[k] = revs[kept[k]].rev;
+	}
+	/* the tip is kept anyway */
+	kept[KEPT] = REVS - 1;
+
+	size_t size = bst_history_size(tree);
+	bst_prune(tree, keep, KEPT);
+	ASSERT(bst_history_size(tree) <= size);
+
+	data = malloc(idatalen * sizeof(int));
+	check(revs[REVS - 1].s, revs[REVS - 1].e);
+
+	for (i = 0; i < UPDATES; i++) {
+		int nrev = kept[rand() % (KEPT + 1)];
+
+		bst_update(tree, revs[nrev].rev);
+		check(revs[nrev].s, revs[nrev].e);
+	}
+
+	/* the pruned history still grows and goes back */
+	fill(0, idatalen / 2);
+	bst_rev_t *rev = bst_commit(tree);
+	bst_update(tree, keep[0]);
+	check(revs[kept[0]].s, revs[kept[0]].e);
+	bst_update(tree, rev);
+	check(0, idatalen / 2);
+
+	free(data);
+}
@@ -0,0 +1,49 @@
+#include "common.h"
+
+#define ZERO_DTIME 1
+/* the checksum event and the eot after it */
+#define TAIL (2 * ZERO_DTIME + 2 * META_HEADER_SIZE + PROPR_HEADER_SIZE + HASH64_SIZE)
+
+static void
+import(const void *data, size_t size, int threads, bool_t sha_ok)
+{
+	file_t file;
+	bool_t ok = !sha_ok;
+
+	set_import_threads(threads);
+	ASSERT(file_import_mem(&file, data, size, &ok) == OK);
+	set_import_threads(1);
+
+	ASSERT_EQ_INT(ok, sha_ok);
+	ASSERT_EQ_INT(file.checksum, CHECKSUM_HASH64);
+	file_fini(&file);
+}
+
+void
+test_checksum()
+{
+	file_t file;
+	void *data;
+	size_t size;
+
+	random_file(&file, 4, 500);
+	file.checksum = CHECKSUM_HASH64;
+	ASSERT(file_export_mem(&file, &data, &size) == OK);
+
+	import(data, size, 1, TRUE);
+	import(data, size, 4, TRUE);
+
+	/* a bit flipped in the middle, and in the last byte covered */
+	size_t flip[] = { size / 2, size - TAIL - 1 };
+	uchar *bytes = data;
+	for (int i = 0; i < LENGTH(flip); i++) {
+		bytes[flip[i]] ^= 1;
+		import(data, size, 1, FALSE);
+		import(data, size, 4, FALSE);
+		bytes[flip[i]] ^= 1;
+	}
+	import(data, size, 4, TRUE);
+
+	free(data);
+	file_fini(&file);
+}
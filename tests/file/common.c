@@ -0,0 +1,66 @@
+#include "common.h"
+
+#define PITCHES 24
+
+/* overlapping notes (not of the same pitch), some with controller changes */
+void
+random_file(file_t *file, int tracks, int notes)
+{
+	file_init(file);
+	for (int i = 0; i < tracks; i++) {
+		track_t *track = track_create(file, CHANMASK_NODRUMS);
+		time_t free_from[PITCHES] = {0};
+		ASSERT(track != NULL);
+		file->track[file->tracks++] = track;
+
+		for (int j = 0; j < notes; j++) {
+			int p = rand() % PITCHES;
+			time_t on = free_from[p] + rand() % 500;
+			free_from[p] = on + 10 + rand() % 300;
+			note_t *note = track_insert(track, on, free_from[p], 48 + p);
+			ASSERT(note != NULL);
+			if (rand() % 20 == 0)
+				note_set_cctrl(note, CCTRL_VOLUME, rand() % 128);
+		}
+	}
+	ASSERT(file_flatten(file) == OK);
+}
+
+static void
+assert_same_map(map_t *a, map_t *b)
+{
+	bst_node_t *i = bst_begin(&a->bst), *j = bst_begin(&b->bst);
+
+	for (; i != bst_end(&a->bst) && j != bst_end(&b->bst); i = bst_next(i), j = bst_next(j)) {
+		ASSERT_EQ_INT(map_time(i), map_time(j));
+		ASSERT_EQ_INT(map_value(i), map_value(j));
+	}
+	ASSERT(i == bst_end(&a->bst) && j == bst_end(&b->bst));
+}
+
+void
+assert_same_file(file_t *a, file_t *b)
+{
+	ASSERT_EQ_INT(a->tracks, b->tracks);
+	for (int t = 0; t < a->tracks; t++) {
+		bst_t *ta = &a->track[t]->notes, *tb = &b->track[t]->notes;
+		bst_node_t *i = bst_begin(ta), *j = bst_begin(tb);
+
+		for (; i != bst_end(ta) && j != bst_end(tb); i = bst_next(i), j = bst_next(j)) {
+			note_t *x = track_note(i), *y = track_note(j);
+			ASSERT_EQ_INT(x->on_time, y->on_time);
+			ASSERT_EQ_INT(x->off_time, y->off_time);
+			ASSERT_EQ_INT(x->pitch, y->pitch);
+			ASSERT_EQ_INT(x->on_vel, y->on_vel);
+			ASSERT_EQ_INT(x->off_vel, y->off_vel);
+			ASSERT_EQ_INT(x->channel->number, y->channel->number);
+		}
+		ASSERT(i == bst_end(ta) && j == bst_end(tb));
+	}
+
+	for (int ch = 0; ch < CHANNELS; ch++)
+		for (int c = 0; c < CCTRLS; c++)
+			assert_same_map(a->channel[ch].ctrl[c], b->channel[ch].ctrl[c]);
+	for (int c = 0; c < FCTRLS; c++)
+		assert_same_map(&a->ctrl[c], &b->ctrl[c]);
+}
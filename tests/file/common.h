@@ -0,0 +1,4 @@
+#include "vomid_test.h"
+
+void random_file(file_t *file, int tracks, int notes);
+void assert_same_file(file_t *a, file_t *b);
@@ -0,0 +1,38 @@
+#include "common.h"
+
+/* a note isolated into a temp channel, then the file taken back to a revision */
+void
+test_isolate()
+{
+	file_t file;
+
+	file_init(&file);
+	track_t *track = track_create(&file, CHANMASK_NODRUMS);
+	file.track[file.tracks++] = track;
+
+	note_t *a = track_insert(track, 0, 100, 60);
+	track_insert(track, 50, 150, 64);
+	file_rev_t *rev = file_commit(&file);
+	ASSERT(rev != NULL);
+
+	isolate_note(a);
+	note_set_cctrl(a, CCTRL_VOLUME, 10);
+	ASSERT_EQ_INT(track->temp_notes, 1);
+	file_update(&file, rev);
+
+	/* the temp channel is emptied, and every note is in one channel */
+	ASSERT_EQ_INT(track->temp_notes, 0);
+	int notes = 0;
+	for (int ch = 0; ch < CHANNELS; ch++)
+		BST_FOREACH(bst_node_t *i, &file.channel[ch].notes) {
+			ASSERT(channel_note(i)->channel == &file.channel[ch]);
+			notes++;
+		}
+	ASSERT_EQ_INT(notes, 2);
+
+	track_insert(track, 200, 300, 67);
+	ASSERT(file_commit(&file) != NULL);
+	ASSERT_EQ_INT(track->temp_notes, 0);
+
+	file_fini(&file);
+}
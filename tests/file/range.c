@@ -0,0 +1,83 @@
+#include "common.h"
+
+#define QUERIES 2000
+
+static int found, stop_at;
+
+static void *
+mark(note_t *note, void *arg)
+{
+	ASSERT_EQ_INT(note->mark, 0);
+	note->mark = 1;
+	return ++found == stop_at ? note : NULL;
+}
+
+/* channel_range() must report exactly the notes a scan of the channel finds */
+static void
+check(channel_t *channel, time_t s, time_t e)
+{
+	found = 0;
+	stop_at = -1;
+	ASSERT(channel_range(channel, s, e, mark, NULL) == NULL);
+
+	int expected = 0;
+	BST_FOREACH(bst_node_t *i, &channel->notes) {
+		note_t *note = channel_note(i);
+		bool_t in = s < note->off_time && note->on_time < e;
+
+		ASSERT_EQ_INT(note->mark, in);
+		expected += in;
+		note->mark = 0;
+	}
+	ASSERT_EQ_INT(found, expected);
+
+	/* and stops at the first callback that returns something */
+	if (expected > 1) {
+		found = 0;
+		stop_at = 1 + rand() % expected;
+		note_t *last = channel_range(channel, s, e, mark, NULL);
+		ASSERT(last != NULL && last->mark);
+		ASSERT_EQ_INT(found, stop_at);
+		BST_FOREACH(bst_node_t *i, &channel->notes)
+			channel_note(i)->mark = 0;
+	}
+}
+
+void
+test_range()
+{
+	file_t file;
+	time_t len = 0;
+
+	random_file(&file, 1, 2000);
+	track_t *track = file.track[0];
+	BST_FOREACH(bst_node_t *i, &track->notes) {
+		note_t *note = track_note(i);
+		len = MAX(len, note->off_time);
+		note->mark = 0;
+	}
+
+	for (int ch = 0; ch < CHANNELS; ch++) {
+		channel_t *channel = &file.channel[ch];
+		if (bst_empty(&channel->notes))
+			continue;
+
+		for (int q = 0; q < QUERIES; q++) {
+			time_t s = rand() % (len + 100) - 50;
+			time_t e = s + rand() % (q % 10 == 0 ? len : 400);
+			check(channel, s, e);
+		}
+
+		/* bounds landing on notes' own times */
+		BST_FOREACH(bst_node_t *i, &channel->notes) {
+			note_t *note = channel_note(i);
+			check(channel, note->on_time, note->off_time);
+			check(channel, note->off_time, note->off_time + 1);
+			check(channel, note->on_time - 1, note->on_time);
+			check(channel, note->on_time, note->on_time);
+		}
+		check(channel, 0, MAX_TIME);
+	}
+
+	file_fini(&file);
+}
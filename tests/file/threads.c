@@ -0,0 +1,26 @@
+#include "common.h"
+
+void
+test_threads()
+{
+	file_t file, one, many;
+	void *data;
+	size_t size;
+
+	random_file(&file, 4, 500);
+	ASSERT(file_export_mem(&file, &data, &size) == OK);
+
+	set_import_threads(1);
+	ASSERT(file_import_mem(&one, data, size, NULL) == OK);
+	set_import_threads(4);
+	ASSERT(file_import_mem(&many, data, size, NULL) == OK);
+	set_import_threads(1);
+
+	ASSERT(one.tracks > 1);
+	assert_same_file(&one, &many);
+
+	free(data);
+	file_fini(&many);
+	file_fini(&one);
+	file_fini(&file);
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h> /* qsort */
+#include <memory.h> /* memcpy */
+#include "vomid_test.h"
+
+#define TRACKS 3
+#define PITCHES 24
+
+typedef struct event_t {
+	time_t time;
+	int len;
+	uchar buf[3];
+} event_t;
+
+static event_t *events;
+static int nevents, max_events;
+static time_t now;
+static time_t free_from[TRACKS][PITCHES];
+
+static void
+record(unsigned char *buf, size_t len, void *arg)
+{
+	if (len > 3)
+		return;
+	if (nevents == max_events) {
+		max_events = max_events * 2 + 64;
+		events = realloc(events, max_events * sizeof(event_t));
+		ASSERT(events != NULL);
+	}
+	event_t *e = &events[nevents++];
+	e->time = now;
+	e->len = len;
+	memcpy(e->buf, buf, len);
+}
+
+static status_t
+delay(time_t dt, int tempo, void *arg)
+{
+	now += dt;
+	return OK;
+}
+
+/* the same tick in any order, events of different channels may be mixed up */
+static int
+event_cmp(const void *_a, const void *_b)
+{
+	const event_t *a = _a, *b = _b;
+
+	CMP(a->time, b->time);
+	CMP(a->len, b->len);
+	return memcmp(a->buf, b->buf, a->len);
+}
+
+/* what the player plays from a fresh publish must be what file_play() plays */
+static void
+check(player_t *p, file_t *file)
+{
+	nevents = 0;
+	now = 0;
+	file_play(file, 0, record, delay, NULL, NULL);
+	int n = nevents;
+	event_t *expected = malloc(n * sizeof(event_t));
+	memcpy(expected, events, n * sizeof(event_t));
+	qsort(expected, n, sizeof(event_t), event_cmp);
+
+	/* a tick at a time, to know when each event was played */
+	nevents = 0;
+	ASSERT(player_seek(p, 0) == OK);
+	for (now = 0; player_step(p, now + 1) == OK; now++)
+		;
+	qsort(events, nevents, sizeof(event_t), event_cmp);
+
+	ASSERT_EQ_INT(nevents, n);
+	for (int i = 0; i < n; i++)
+		ASSERT(event_cmp(&events[i], &expected[i]) == 0);
+	free(expected);
+}
+
+/* notes of the same pitch don't overlap, or the track can't be flattened */
+static void
+add_notes(file_t *file, int track, int notes)
+{
+	for (int j = 0; j < notes; j++) {
+		int pitch = rand() % PITCHES;
+		time_t on = free_from[track][pitch] + rand() % 500;
+		free_from[track][pitch] = on + 10 + rand() % 300;
+
+		note_t *note = track_insert(file->track[track], on, free_from[track][pitch], 48 + pitch);
+		ASSERT(note != NULL);
+		if (rand() % 20 == 0)
+			note_set_cctrl(note, CCTRL_VOLUME, rand() % 128);
+	}
+}
+
+void
+test_publish()
+{
+	file_t file;
+
+	file_init(&file);
+	memset(free_from, 0, sizeof(free_from));
+	for (int i = 0; i < TRACKS; i++) {
+		file.track[file.tracks++] = track_create(&file, CHANMASK_NODRUMS);
+		add_notes(&file, i, 200);
+	}
+	map_set(&file.ctrl[FCTRL_TEMPO], 1000, TEMPO_MIDI(90));
+	file_rev_t *first = file_commit(&file);
+	ASSERT(first != NULL);
+
+	player_t *p = player_create(&file, record, NULL);
+	if (p == NULL) {
+		file_fini(&file);
+		return;
+	}
+	check(p, &file);
+
+	/* one track edited and committed: its channels are rendered again */
+	erase_note(track_note(bst_root(&file.track[1]->notes)));
+	add_notes(&file, 1, 20);
+	ASSERT(file_commit(&file) != NULL);
+	check(p, &file);
+
+	/* edits that aren't committed yet */
+	add_notes(&file, 2, 20);
+	check(p, &file);
+
+	/* the tempo, committed */
+	map_set(&file.ctrl[FCTRL_TEMPO], 2000, TEMPO_MIDI(150));
+	ASSERT(file_commit(&file) != NULL);
+	check(p, &file);
+
+	/* back to where it all began */
+	file_update(&file, first);
+	check(p, &file);
+
+	player_destroy(p);
+	free(events);
+	events = NULL;
+	nevents = max_events = 0;
+	file_fini(&file);
+}
@@ -0,0 +1,142 @@
+#include <memory.h> /* memcpy */
+#include "vomid_test.h"
+
+#define EVENTS 64
+#define VOLUME 7 /* controller number */
+
+static uchar events[EVENTS][3];
+static int nevents;
+static note_t *a, *b;
+
+/* called from player_step(), on this thread */
+static void
+record(unsigned char *buf, size_t len, void *arg)
+{
+	if (len == 3 && nevents < EVENTS)
+		memcpy(events[nevents++], buf, 3);
+}
+
+static bool_t
+note_on(const uchar *ev, int pitch)
+{
+	return (ev[0] & 0xF0) == VOICE_NOTEON && ev[1] == pitch && ev[2] != 0;
+}
+
+static bool_t
+note_off(const uchar *ev, int pitch)
+{
+	int status = ev[0] & 0xF0;
+
+	return ev[1] == pitch &&
+		(status == VOICE_NOTEOFF || (status == VOICE_NOTEON && ev[2] == 0));
+}
+
+static bool_t
+volume(const uchar *ev, int value)
+{
+	return (ev[0] & 0xF0) == VOICE_CONTROLLER && ev[1] == VOLUME && ev[2] == value;
+}
+
+/* index of the first matching event, -1 if there is none */
+static int
+find(bool_t (*match)(const uchar *, int), int arg)
+{
+	for (int i = 0; i < nevents; i++)
+		if (match(events[i], arg))
+			return i;
+	return -1;
+}
+
+static int
+count(bool_t (*match)(const uchar *, int), int arg)
+{
+	int ret = 0;
+
+	for (int i = 0; i < nevents; i++)
+		ret += match(events[i], arg);
+	return ret;
+}
+
+/* plays the file, publishing the edits at tick 480; returns the events played */
+static int
+play(file_t *file, event_clb_t clb)
+{
+	player_t *p = player_create(file, clb, NULL);
+	if (p == NULL)
+		return -1;
+
+	ASSERT(player_step(p, 480) == OK);
+	ASSERT_EQ_INT(player_position(p), 480);
+	/* only what's before 480 is played: the volume and two notes */
+	ASSERT_EQ_INT(nevents, (clb != NULL ? 3 : 0));
+
+	/* heard from 480 on */
+	erase_note(b);
+	note_set_cctrl(a, CCTRL_VOLUME, 50);
+	ASSERT(player_publish(p) == OK);
+
+	ASSERT(player_step(p, MAX_TIME) == STOP);
+	ASSERT(!player_playing(p));
+	player_destroy(p);
+	return nevents;
+}
+
+static void
+make_file(file_t *file)
+{
+	file_init(file);
+	track_t *track = track_create(file, CHANMASK_NODRUMS);
+	file->track[file->tracks++] = track;
+
+	/* two long notes, and one starting halfway, where the switch happens */
+	a = track_insert(track, 0, 960, 60);
+	b = track_insert(track, 0, 960, 64);
+	track_insert(track, 480, 720, 67);
+	note_set_cctrl(a, CCTRL_VOLUME, 90);
+}
+
+void
+test_switch()
+{
+	file_t file;
+
+	make_file(&file);
+	nevents = 0;
+	if (play(&file, record) < 0) {
+		/* no threads or no clock to play with */
+		file_fini(&file);
+		return;
+	}
+	file_fini(&file);
+
+	int switched = find(note_on, 67);
+	ASSERT(switched >= 0);
+
+	/* the erased note is cut at the switch */
+	ASSERT_EQ_INT(count(note_on, 64), 1);
+	ASSERT_EQ_INT(count(note_off, 64), 1);
+	ASSERT(find(note_off, 64) < switched);
+
+	/* the one left goes on uncut, and ends at its time */
+	ASSERT_EQ_INT(count(note_on, 60), 1);
+	ASSERT_EQ_INT(count(note_off, 60), 1);
+	ASSERT(find(note_off, 60) > switched);
+
+	/* the controller is brought to its new value at the switch */
+	ASSERT_EQ_INT(count(volume, 50), 1);
+	ASSERT(find(volume, 50) < switched);
+	ASSERT_EQ_INT(count(volume, 90), 1);
+	ASSERT(find(volume, 90) < find(volume, 50));
+
+	/* the same goes to the output device */
+	null_stats_t stats;
+	int played = nevents;
+
+	make_file(&file);
+	nevents = 0;
+	ASSERT(set_device(OUTPUT_DEVICE, "null/") == OK);
+	play(&file, NULL);
+	null_stats(&stats);
+	ASSERT_EQ_INT(stats.events, played);
+	file_fini(&file);
+}